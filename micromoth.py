@@ -250,25 +250,35 @@ def simulate(qc,shots=1024,get='counts',noise_model=[]):
           assert  not ((gate[-1]==j) and m[j]), 'Incorrect or missing measure command.'
           m[j] = (gate==('m',j,j))
         
+      # The running totals of the probabilities are found once, so that each sample is a binary search rather than a scan.
+      cumu=[]
+      total=0
+      for p in probs:
+        total += p
+        cumu.append(total)
       # The `shots` samples that result are then collected in the list `m`.
       m=[]
       for _ in range(shots):
-        cumu=0
-        un=True
-        r=random.random()
-        for j,p in enumerate(probs):
-          cumu += p
-          if r<cumu and un:    
-            # When the `j`th element is chosen, get the n bit representation of j.
-            raw_out=('{0:0'+str(qc.num_qubits)+'b}').format(j)
-            # Convert this into an m bit string, with the order specified by the measure commands
-            out_list = ['0']*qc.num_clbits
-            for bit in outputnum_clbitsap:
-              out_list[qc.num_clbits-1-bit] = raw_out[qc.num_qubits-1-outputnum_clbitsap[bit]]
-            out = ''.join(out_list)
-            # Add this to the list of samples
-            m.append(out)
-            un=False
+        r=random.random()*total
+        # Find the first `j` for which r<cumu[j].
+        lo=0
+        hi=len(cumu)-1
+        while lo<hi:
+          mid=(lo+hi)//2
+          if r<cumu[mid]:
+            hi=mid
+          else:
+            lo=mid+1
+        j=lo
+        # When the `j`th element is chosen, get the n bit representation of j.
+        raw_out=('{0:0'+str(qc.num_qubits)+'b}').format(j)
+        # Convert this into an m bit string, with the order specified by the measure commands
+        out_list = ['0']*qc.num_clbits
+        for bit in outputnum_clbitsap:
+          out_list[qc.num_clbits-1-bit] = raw_out[qc.num_qubits-1-outputnum_clbitsap[bit]]
+        out = ''.join(out_list)
+        # Add this to the list of samples
+        m.append(out)
             
       # For the memory output, we simply return `m`
       if get=='memory':
@@ -23,6 +23,88 @@
 
 #include "MicroMothArduinoMath.h"
 
+// Scratch memory for simulate. The statevector, output map, probabilities and counts of a run are all carved out of
+// one block, which is kept from one run to the next and only reallocated when a run needs more. Repeated runs of the
+// same size therefore never touch the heap, and cannot fragment it.
+// Defining MICROMOTH_ARENA_BYTES before including this file gives a fixed block of that size instead, so that peak
+// memory is known at compile time. Runs that do not fit in it are refused. The fixed block is shared by all circuits,
+// so that it is only paid for once, and a run of any circuit reuses it.
+class Arena {
+  public:
+    Arena() : used(0) {
+#ifdef MICROMOTH_ARENA_BYTES
+      block = shared_block();
+      capacity = ((MICROMOTH_ARENA_BYTES + 3) / 4) * 4;
+#else
+      block = nullptr;
+      capacity = 0;
+#endif
+    }
+
+    ~Arena() {
+      release();
+    }
+
+    // the block is owned, so copies would free it twice
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    // Bytes taken by a buffer of the given size, which keeps every buffer 4-byte aligned.
+    static size_t rounded(size_t bytes) {
+      return (bytes + 3) & ~(size_t)3;
+    }
+
+    size_t size() const {
+      return capacity;
+    }
+
+    // Frees the block, unless it is the fixed one.
+    void release() {
+#ifndef MICROMOTH_ARENA_BYTES
+      delete[] block;
+      block = nullptr;
+      capacity = 0;
+#endif
+      used = 0;
+    }
+
+    // Starts a new run needing the given number of bytes, growing the block if needed.
+    // Everything taken for the previous run is given up. Returns false if there is not enough memory.
+    bool reserve(size_t bytes) {
+      used = 0;
+      if (bytes <= capacity) return true;
+#ifdef MICROMOTH_ARENA_BYTES
+      return false;
+#else
+      release();
+      block = new uint8_t[bytes];
+      if (!block) return false;
+      capacity = bytes;
+      return true;
+#endif
+    }
+
+    // Gives the next n elements of the block. reserve must have allowed for them.
+    template <typename T>
+    T* take(size_t n) {
+      T* out = (T*)(block + used);
+      used += rounded(sizeof(T) * n);
+      return out;
+    }
+
+  private:
+#ifdef MICROMOTH_ARENA_BYTES
+    // a static inside a function, so that the header needs no separate definition of it
+    static uint8_t* shared_block() {
+      static uint32_t storage[(MICROMOTH_ARENA_BYTES + 3) / 4];
+      return (uint8_t*)storage;
+    }
+#endif
+    uint8_t* block;
+    size_t capacity;
+    size_t used;
+};
+
 class QuantumCircuit {
   public:
     enum GateOp { INIT, X, RX, RZ, H, CX, CRX, CRZ, SWAP, RY, Z, T, Y, M };
@@ -45,7 +127,9 @@ class QuantumCircuit {
 
     String name;
 
+    // points into arena, and is valid until the next simulate (of any circuit, if the arena is the fixed block)
     ComplexNumber* statevectors;
+    Arena arena;
 
     QuantumCircuit(int n, int m = 0) : num_qubits(n), num_clbits(m), size(0), capacity(10) {
       name = "";
@@ -55,7 +139,6 @@ class QuantumCircuit {
 
     ~QuantumCircuit() {
       delete[] data;
-      delete[] statevectors;
     }
 
     void resize() {
@@ -165,32 +248,37 @@ class QuantumCircuit {
     // noiseModel: array of num_qubits measurement-error probabilities, or nullptr
     void simulate(QuantumCircuit &qc, int shots = 1024, const char* get = "counts", const float* noiseModel = nullptr) {
       int ssize = 1 << qc.num_qubits;
+      int clbits = (qc.num_clbits > 0) ? qc.num_clbits : 1;
+      int num_cstates = 1 << qc.num_clbits;
+      bool sampling = strcmp(get, "statevector") != 0;
 
-      // Free stale allocation first so system_check sees accurately-available RAM
-      delete[] statevectors;
-      statevectors = nullptr;
-
-      int required = (int)(sizeof(ComplexNumber) * ssize) + 200;
-      system_check(required);
-
-      statevectors = new ComplexNumber[ssize];
-      if (!statevectors) {
-        Serial.println(F("Error: out of memory (statevectors)"));
+      // all buffers for the run come from the arena, with probs and counts only needed when sampling
+      size_t required = Arena::rounded(sizeof(ComplexNumber) * ssize) + Arena::rounded(sizeof(int) * clbits);
+      if (sampling) {
+        required += Arena::rounded(sizeof(float) * ssize) + Arena::rounded(sizeof(int) * num_cstates);
+      }
+#ifndef MICROMOTH_ARENA_BYTES
+      if (required > arena.size()) {
+        // Free stale allocation first so system_check sees accurately-available RAM
+        statevectors = nullptr;
+        arena.release();
+        system_check((int)required + 200);
+      }
+#endif
+      if (!arena.reserve(required)) {
+        statevectors = nullptr;
+        Serial.println(F("Error: out of memory (arena)"));
         return;
       }
 
+      statevectors = arena.take<ComplexNumber>(ssize);
       for (int i = 0; i < ssize; i++) {
         statevectors[i] = {0.0f, 0.0f};
       }
       statevectors[0] = {1.0f, 0.0f};
 
       // Fix 3: pre-scan to build outputmap (clbit -> qubit) from M ops
-      int clbits = (qc.num_clbits > 0) ? qc.num_clbits : 1;
-      int* outputmap = new int[clbits];
-      if (!outputmap) {
-        Serial.println(F("Error: out of memory (outputmap)"));
-        return;
-      }
+      int* outputmap = arena.take<int>(clbits);
       for (int i = 0; i < clbits; i++) outputmap[i] = -1;
       for (int i = 0; i < qc.size; i++) {
         if (qc.data[i].gate == QuantumCircuit::M) {
@@ -215,49 +303,41 @@ class QuantumCircuit {
           // handled by outputmap pre-scan above
         }
         else if (g.gate == QuantumCircuit::X) {
-          for (int i0 = 0; i0 < (1 << j); i0++) {
-            for (int i1 = 0; i1 < (1 << (qc.num_qubits - j - 1)); i1++) {
-              int b0 = i0 + (1 << (j + 1)) * i1;
-              int b1 = b0 + (1 << j);
-              ComplexNumber temp = statevectors[b0];
-              statevectors[b0] = statevectors[b1];
-              statevectors[b1] = temp;
-            }
+          for (int i = 0; i < ssize / 2; i++) {
+            int b0 = insert_zero_bit(i, j);
+            int b1 = b0 | (1 << j);
+            ComplexNumber temp = statevectors[b0];
+            statevectors[b0] = statevectors[b1];
+            statevectors[b1] = temp;
           }
         }
         else if (g.gate == QuantumCircuit::H) {
-          for (int i0 = 0; i0 < (1 << j); i0++) {
-            for (int i1 = 0; i1 < (1 << (qc.num_qubits - j - 1)); i1++) {
-              int b0 = i0 + (1 << (j + 1)) * i1;
-              int b1 = b0 + (1 << j);
-              ComplexNumber* r = qc.superposition(statevectors[b0], statevectors[b1]);
-              statevectors[b0] = r[0];
-              statevectors[b1] = r[1];
-            }
+          for (int i = 0; i < ssize / 2; i++) {
+            int b0 = insert_zero_bit(i, j);
+            int b1 = b0 | (1 << j);
+            ComplexNumber* r = qc.superposition(statevectors[b0], statevectors[b1]);
+            statevectors[b0] = r[0];
+            statevectors[b1] = r[1];
           }
         }
         else if (g.gate == QuantumCircuit::RX) {
           float th = g.angle;
-          for (int i0 = 0; i0 < (1 << j); i0++) {
-            for (int i1 = 0; i1 < (1 << (qc.num_qubits - j - 1)); i1++) {
-              int b0 = i0 + (1 << (j + 1)) * i1;
-              int b1 = b0 + (1 << j);
-              ComplexNumber* r = qc.rotate(statevectors[b0], statevectors[b1], th);
-              statevectors[b0] = r[0];
-              statevectors[b1] = r[1];
-            }
+          for (int i = 0; i < ssize / 2; i++) {
+            int b0 = insert_zero_bit(i, j);
+            int b1 = b0 | (1 << j);
+            ComplexNumber* r = qc.rotate(statevectors[b0], statevectors[b1], th);
+            statevectors[b0] = r[0];
+            statevectors[b1] = r[1];
           }
         }
         else if (g.gate == QuantumCircuit::RZ) {
           float th = g.angle;
-          for (int i0 = 0; i0 < (1 << j); i0++) {
-            for (int i1 = 0; i1 < (1 << (qc.num_qubits - j - 1)); i1++) {
-              int b0 = i0 + (1 << (j + 1)) * i1;
-              int b1 = b0 + (1 << j);
-              ComplexNumber* r = qc.phaseturn(statevectors[b0], statevectors[b1], th);
-              statevectors[b0] = r[0];
-              statevectors[b1] = r[1];
-            }
+          for (int i = 0; i < ssize / 2; i++) {
+            int b0 = insert_zero_bit(i, j);
+            int b1 = b0 | (1 << j);
+            ComplexNumber* r = qc.phaseturn(statevectors[b0], statevectors[b1], th);
+            statevectors[b0] = r[0];
+            statevectors[b1] = r[1];
           }
         }
         else if (g.gate == QuantumCircuit::CX) {
@@ -265,17 +345,13 @@ class QuantumCircuit {
           int t = g.target;
           int l = min(c, t);
           int h = max(c, t);
-          for (int i0 = 0; i0 < (1 << l); i0++) {
-            for (int i1 = 0; i1 < (1 << (h - l - 1)); i1++) {
-              for (int i2 = 0; i2 < (1 << (qc.num_qubits - h - 1)); i2++) {
-                int b00 = i0 + (1 << (l + 1)) * i1 + (1 << (h + 1)) * i2;
-                int b10 = b00 + (1 << c);
-                int b11 = b10 + (1 << t);
-                ComplexNumber temp = statevectors[b10];
-                statevectors[b10] = statevectors[b11];
-                statevectors[b11] = temp;
-              }
-            }
+          for (int i = 0; i < ssize / 4; i++) {
+            int b00 = insert_zero_bit(insert_zero_bit(i, l), h);
+            int b10 = b00 + (1 << c);
+            int b11 = b10 + (1 << t);
+            ComplexNumber temp = statevectors[b10];
+            statevectors[b10] = statevectors[b11];
+            statevectors[b11] = temp;
           }
         }
         else if (g.gate == QuantumCircuit::SWAP) {
@@ -283,17 +359,13 @@ class QuantumCircuit {
           int t = g.target;
           int l = min(c, t);
           int h = max(c, t);
-          for (int i0 = 0; i0 < (1 << l); i0++) {
-            for (int i1 = 0; i1 < (1 << (h - l - 1)); i1++) {
-              for (int i2 = 0; i2 < (1 << (qc.num_qubits - h - 1)); i2++) {
-                int b00 = i0 + (1 << (l + 1)) * i1 + (1 << (h + 1)) * i2;
-                int b01 = b00 + (1 << t);
-                int b10 = b00 + (1 << c);
-                ComplexNumber temp = statevectors[b01];
-                statevectors[b01] = statevectors[b10];
-                statevectors[b10] = temp;
-              }
-            }
+          for (int i = 0; i < ssize / 4; i++) {
+            int b00 = insert_zero_bit(insert_zero_bit(i, l), h);
+            int b01 = b00 + (1 << t);
+            int b10 = b00 + (1 << c);
+            ComplexNumber temp = statevectors[b01];
+            statevectors[b01] = statevectors[b10];
+            statevectors[b10] = temp;
           }
         }
         else if (g.gate == QuantumCircuit::CRX) {
@@ -302,17 +374,13 @@ class QuantumCircuit {
           int t = g.target;
           int l = min(c, t);
           int h = max(c, t);
-          for (int i0 = 0; i0 < (1 << l); i0++) {
-            for (int i1 = 0; i1 < (1 << (h - l - 1)); i1++) {
-              for (int i2 = 0; i2 < (1 << (qc.num_qubits - h - 1)); i2++) {
-                int b00 = i0 + (1 << (l + 1)) * i1 + (1 << (h + 1)) * i2;
-                int b10 = b00 + (1 << c);
-                int b11 = b10 + (1 << t);
-                ComplexNumber* r = qc.rotate(statevectors[b10], statevectors[b11], th);
-                statevectors[b10] = r[0];
-                statevectors[b11] = r[1];
-              }
-            }
+          for (int i = 0; i < ssize / 4; i++) {
+            int b00 = insert_zero_bit(insert_zero_bit(i, l), h);
+            int b10 = b00 + (1 << c);
+            int b11 = b10 + (1 << t);
+            ComplexNumber* r = qc.rotate(statevectors[b10], statevectors[b11], th);
+            statevectors[b10] = r[0];
+            statevectors[b11] = r[1];
           }
         }
         else if (g.gate == QuantumCircuit::CRZ) {
@@ -321,34 +389,24 @@ class QuantumCircuit {
           int t = g.target;
           int l = min(c, t);
           int h = max(c, t);
-          for (int i0 = 0; i0 < (1 << l); i0++) {
-            for (int i1 = 0; i1 < (1 << (h - l - 1)); i1++) {
-              for (int i2 = 0; i2 < (1 << (qc.num_qubits - h - 1)); i2++) {
-                int b00 = i0 + (1 << (l + 1)) * i1 + (1 << (h + 1)) * i2;
-                int b10 = b00 + (1 << c);
-                int b11 = b10 + (1 << t);
-                ComplexNumber* r = qc.phaseturn(statevectors[b10], statevectors[b11], th);
-                statevectors[b10] = r[0];
-                statevectors[b11] = r[1];
-              }
-            }
+          for (int i = 0; i < ssize / 4; i++) {
+            int b00 = insert_zero_bit(insert_zero_bit(i, l), h);
+            int b10 = b00 + (1 << c);
+            int b11 = b10 + (1 << t);
+            ComplexNumber* r = qc.phaseturn(statevectors[b10], statevectors[b11], th);
+            statevectors[b10] = r[0];
+            statevectors[b11] = r[1];
           }
         }
         // Fix 6: circuitPrint removed from gate loop
       }
 
-      if (strcmp(get, "statevector") == 0) {
-        delete[] outputmap;
+      if (!sampling) {
         return;
       }
 
       // Fix 3: compute probabilities from statevector
-      float* probs = new float[ssize];
-      if (!probs) {
-        Serial.println(F("Error: out of memory (probs)"));
-        delete[] outputmap;
-        return;
-      }
+      float* probs = arena.take<float>(ssize);
       for (int i = 0; i < ssize; i++) {
         probs[i] = statevectors[i].real * statevectors[i].real + statevectors[i].imag * statevectors[i].imag;
       }
@@ -357,48 +415,50 @@ class QuantumCircuit {
       if (noiseModel) {
         for (int j = 0; j < qc.num_qubits; j++) {
           float p_meas = noiseModel[j];
-          for (int i0 = 0; i0 < (1 << j); i0++) {
-            for (int i1 = 0; i1 < (1 << (qc.num_qubits - j - 1)); i1++) {
-              int b0 = i0 + (1 << (j + 1)) * i1;
-              int b1 = b0 + (1 << j);
-              float p0 = probs[b0];
-              float p1 = probs[b1];
-              probs[b0] = (1.0f - p_meas) * p0 + p_meas * p1;
-              probs[b1] = (1.0f - p_meas) * p1 + p_meas * p0;
-            }
+          for (int i = 0; i < ssize / 2; i++) {
+            int b0 = insert_zero_bit(i, j);
+            int b1 = b0 | (1 << j);
+            float p0 = probs[b0];
+            float p1 = probs[b1];
+            probs[b0] = (1.0f - p_meas) * p0 + p_meas * p1;
+            probs[b1] = (1.0f - p_meas) * p1 + p_meas * p0;
           }
         }
       }
 
       // Fix 3: sample shots and accumulate counts, matching Python micromoth.py lines 255-271
       if (strcmp(get, "counts") == 0 || strcmp(get, "memory") == 0) {
-        int num_cstates = 1 << qc.num_clbits;
-        int* counts = new int[num_cstates];
-        if (!counts) {
-          Serial.println(F("Error: out of memory (counts)"));
-          delete[] probs;
-          delete[] outputmap;
-          return;
-        }
+        int* counts = arena.take<int>(num_cstates);
         for (int i = 0; i < num_cstates; i++) counts[i] = 0;
 
+        // probs is turned into running totals in place, so that each shot is a binary search rather than a scan
+        for (int j = 1; j < ssize; j++) {
+          probs[j] += probs[j - 1];
+        }
+        float total = probs[ssize - 1];
+
         for (int shot = 0; shot < shots; shot++) {
-          float cumu = 0.0f;
-          float r = custom_random(0.0f, 1.0f);
-          for (int j = 0; j < ssize; j++) {
-            cumu += probs[j];
-            if (r < cumu) {
-              // Map qubit-state index j to classical output integer via outputmap
-              int out = 0;
-              for (int bit = 0; bit < qc.num_clbits; bit++) {
-                if (outputmap[bit] >= 0) {
-                  out |= (((j >> outputmap[bit]) & 1) << bit);
-                }
-              }
-              counts[out]++;
-              break;
+          // the first j with r < probs[j]
+          float r = custom_random(0.0f, 1.0f) * total;
+          int lo = 0;
+          int hi = ssize - 1;
+          while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            if (r < probs[mid]) {
+              hi = mid;
+            } else {
+              lo = mid + 1;
+            }
+          }
+          int j = lo;
+          // Map qubit-state index j to classical output integer via outputmap
+          int out = 0;
+          for (int bit = 0; bit < qc.num_clbits; bit++) {
+            if (outputmap[bit] >= 0) {
+              out |= (((j >> outputmap[bit]) & 1) << bit);
             }
           }
+          counts[out]++;
         }
 
         Serial.println(F("Counts:"));
@@ -411,12 +471,7 @@ class QuantumCircuit {
             Serial.println(counts[i]);
           }
         }
-
-        delete[] counts;
       }
-
-      delete[] probs;
-      delete[] outputmap;
     }
 
     void circuitPrint(QuantumCircuit::GateOp tg) {
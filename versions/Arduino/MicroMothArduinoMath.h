@@ -33,6 +33,14 @@ float custom_random(double minFloat, double maxFloat)
   return (float)(minFloat + (float)random(1000000L) * (maxFloat - minFloat) / 1000000.0f);
 }
 
+// Inserts a 0 into the bit string of i at position q, shifting the higher bits up by one.
+// Looping i over 2^(n-1) values gives the index of every statevector element whose bit q is 0.
+// Used twice (lowest position first) it gives the 2^(n-2) indices for which two bits are both 0.
+inline int insert_zero_bit(int i, int q) {
+  int low = i & ((1 << q) - 1);
+  return ((i ^ low) << 1) | low;
+}
+
 struct ComplexNumber {
   float real;
   float imag;
@@ -131,21 +131,29 @@ def simulate(qc,shots=1024,get='counts',noise_model=[]):
         for j in range(qc.num_qubits):
           assert  not ((gate[-1]==j) and m[j]), 'Incorrect or missing measure command.'
           m[j] = (gate==('m',j,j))
+      cumu=[]
+      total=0
+      for p in probs:
+        total += p
+        cumu.append(total)
       m=[]
       for _ in range(shots):
-        cumu=0
-        un=True
-        r=random.random()
-        for j,p in enumerate(probs):
-          cumu += p
-          if r<cumu and un:    
-            raw_out=('{0:0'+str(qc.num_qubits)+'b}').format(j)
-            out_list = ['0']*qc.num_clbits
-            for bit in outputnum_clbitsap:
-              out_list[qc.num_clbits-1-bit] = raw_out[qc.num_qubits-1-outputnum_clbitsap[bit]]
-            out = ''.join(out_list)
-            m.append(out)
-            un=False
+        r=random.random()*total
+        lo=0
+        hi=len(cumu)-1
+        while lo<hi:
+          mid=(lo+hi)//2
+          if r<cumu[mid]:
+            hi=mid
+          else:
+            lo=mid+1
+        j=lo
+        raw_out=('{0:0'+str(qc.num_qubits)+'b}').format(j)
+        out_list = ['0']*qc.num_clbits
+        for bit in outputnum_clbitsap:
+          out_list[qc.num_clbits-1-bit] = raw_out[qc.num_qubits-1-outputnum_clbitsap[bit]]
+        out = ''.join(out_list)
+        m.append(out)
       if get=='memory':
         return m
       else:
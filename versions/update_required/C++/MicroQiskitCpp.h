@@ -14,12 +14,23 @@ In development on replit (https://repl.it/@quantum_jim/MicroQiskitC) and on gith
 #define MICROQISKITCPP_H
 #include <iostream>
 #include <stdlib.h>
+#include <stdio.h>
 #include <math.h>
 #include <vector>
 #include <string>
 #include <complex>  
 #include <ctime>
 #include <map>
+#include <algorithm>
+#include <cstring>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <atomic>
+#include <random>
+#include <array>
 #define RESET   "\033[0m"
 #define RED     "\033[31m"      /* Red */
 #define ERROR(MESSAGE) error_handler(MESSAGE)
@@ -32,12 +43,626 @@ void error_handler(const string message)
   abort();
 } 
 
+// Inserts a 0 into the bit string of i at position q, shifting the higher bits up by one.
+// Looping i over 2^(n-1) values gives the index b0 of every pair of amplitudes that differ only on bit q.
+// Doing this twice (lowest position first) gives the 2^(n-2) indices for which two bits are both 0.
+inline size_t insert_zero_bit (size_t i, int q) {
+  size_t low = i & ((size_t(1)<<q)-1);
+  return ((i^low)<<1) | low;
+}
+
+// The number of 1s in the bit string of x, with the builtin where there is one.
+inline int count_ones (unsigned long long x) {
+#if defined(__GNUC__) || defined(__clang__)
+  return __builtin_popcountll(x);
+#else
+  int n = 0;
+  for (; x; x&=x-1){
+    n++;
+  }
+  return n;
+#endif
+}
+
+// The position of the lowest 1 in the bit string of x, which must not be 0.
+inline int lowest_one (unsigned long long x) {
+#if defined(__GNUC__) || defined(__clang__)
+  return __builtin_ctzll(x);
+#else
+  int q = 0;
+  for (; !(x&1); x>>=1){
+    q++;
+  }
+  return q;
+#endif
+}
+
+// Gives the index b0 of each pair of amplitudes acted on by a gate with target t, and control c (or -1 for no control).
+// Uncontrolled gates have 2^(n-1) pairs, for which bit t is 0. Controlled gates have 2^(n-2), for which bit t is 0 and bit c is 1.
+struct PairIndexer {
+  int l, h;
+  size_t cbit;
+
+  PairIndexer (int t, int c) {
+    if (c<0){
+      l = t;
+      h = -1;
+      cbit = 0;
+    } else {
+      l = min(c,t);
+      h = max(c,t);
+      cbit = size_t(1)<<c;
+    }
+  }
+
+  size_t operator() (size_t i) const {
+    size_t b0 = insert_zero_bit(i,l);
+    if (h>=0){
+      b0 = insert_zero_bit(b0,h);
+    }
+    return b0 | cbit;
+  }
+};
+
+// The gate kernels apply a 2x2 matrix m = {m00,m01,m10,m11} to the pairs numbered from begin to end (not including end).
+// For each pair, e0 (bit t is 0) becomes m00*e0+m01*e1 and e1 (bit t is 1) becomes m10*e0+m11*e1.
+// The amplitudes are complex<R> for R either double or float. Matrices are always given in double, and rounded once here.
+
+template <typename R>
+inline void apply_matrix_scalar (complex<R> *ket, int t, int c, const complex<double> m[4], size_t begin, size_t end) {
+  PairIndexer pair (t,c);
+  size_t tbit = size_t(1)<<t;
+  if (m[0]==0.0 && m[1]==1.0 && m[2]==1.0 && m[3]==0.0){
+    // the x matrix just flips the values
+    for (size_t i=begin; i<end; i++){
+      size_t b0 = pair(i);
+      swap(ket[b0],ket[b0|tbit]);
+    }
+    return;
+  }
+  R m0r = m[0].real(), m0i = m[0].imag(), m1r = m[1].real(), m1i = m[1].imag();
+  R m2r = m[2].real(), m2i = m[2].imag(), m3r = m[3].real(), m3i = m[3].imag();
+  for (size_t i=begin; i<end; i++){
+    size_t b0 = pair(i);
+    size_t b1 = b0|tbit;
+    R e0r = ket[b0].real(), e0i = ket[b0].imag();
+    R e1r = ket[b1].real(), e1i = ket[b1].imag();
+    ket[b0] = complex<R>( m0r*e0r - m0i*e0i + m1r*e1r - m1i*e1i, m0r*e0i + m0i*e0r + m1r*e1i + m1i*e1r );
+    ket[b1] = complex<R>( m2r*e0r - m2i*e0i + m3r*e1r - m3i*e1i, m2r*e0i + m2i*e0r + m3r*e1i + m3i*e1r );
+  }
+}
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__)) && !defined(MICROQISKIT_NO_SIMD)
+#define MICROQISKIT_SIMD
+#include <immintrin.h>
+
+// The SIMD kernels are compiled for AVX2 and AVX-512 regardless of the compiler flags, and chosen at runtime by CPUID.
+// A register holds 2 (AVX2) or 4 (AVX-512) complex amplitudes, with real and imaginary parts interleaved.
+//
+// When the qubits of a gate are both above the register width (the 'high' case), consecutive pairs have consecutive b0,
+// so a register of e0 values and a register of e1 values are loaded from two contiguous stripes.
+// When the target is below it (the 'low' case), e0 and e1 are interleaved within one register. The register is then
+// multiplied by the diagonal coefficients, and a copy with e0 and e1 swapped by the off-diagonal ones.
+
+__attribute__((target("avx2,fma")))
+inline void apply_matrix_avx2 (complex<double> *ket, int t, int c, const complex<double> m[4], size_t begin, size_t end) {
+  PairIndexer pair (t,c);
+  size_t tbit = size_t(1)<<t;
+  double *k = reinterpret_cast<double*>(ket);
+  if (t>=1){
+    __m256d m0r = _mm256_set1_pd(m[0].real()), m0i = _mm256_set1_pd(m[0].imag());
+    __m256d m1r = _mm256_set1_pd(m[1].real()), m1i = _mm256_set1_pd(m[1].imag());
+    __m256d m2r = _mm256_set1_pd(m[2].real()), m2i = _mm256_set1_pd(m[2].imag());
+    __m256d m3r = _mm256_set1_pd(m[3].real()), m3i = _mm256_set1_pd(m[3].imag());
+    for (size_t i=begin; i<end; i+=2){
+      size_t b0 = pair(i);
+      double *p0 = k + 2*b0;
+      double *p1 = k + 2*(b0|tbit);
+      __m256d e0 = _mm256_loadu_pd(p0);
+      __m256d e1 = _mm256_loadu_pd(p1);
+      // with the real and imaginary parts swapped
+      __m256d s0 = _mm256_permute_pd(e0,5);
+      __m256d s1 = _mm256_permute_pd(e1,5);
+      _mm256_storeu_pd(p0, _mm256_fmadd_pd(e0, m0r, _mm256_fmaddsub_pd(e1, m1r, _mm256_fmadd_pd(s0, m0i, _mm256_mul_pd(s1, m1i)))));
+      _mm256_storeu_pd(p1, _mm256_fmadd_pd(e0, m2r, _mm256_fmaddsub_pd(e1, m3r, _mm256_fmadd_pd(s0, m2i, _mm256_mul_pd(s1, m3i)))));
+    }
+  } else {
+    // the register holds {e0,e1} for a single pair
+    __m256d dr = _mm256_setr_pd(m[0].real(), m[0].real(), m[3].real(), m[3].real());
+    __m256d di = _mm256_setr_pd(m[0].imag(), m[0].imag(), m[3].imag(), m[3].imag());
+    __m256d or_ = _mm256_setr_pd(m[1].real(), m[1].real(), m[2].real(), m[2].real());
+    __m256d oi = _mm256_setr_pd(m[1].imag(), m[1].imag(), m[2].imag(), m[2].imag());
+    for (size_t i=begin; i<end; i++){
+      double *p = k + 2*pair(i);
+      __m256d v = _mm256_loadu_pd(p);
+      __m256d w = _mm256_permute2f128_pd(v,v,1);
+      __m256d sv = _mm256_permute_pd(v,5);
+      __m256d sw = _mm256_permute_pd(w,5);
+      _mm256_storeu_pd(p, _mm256_fmadd_pd(v, dr, _mm256_fmaddsub_pd(w, or_, _mm256_fmadd_pd(sv, di, _mm256_mul_pd(sw, oi)))));
+    }
+  }
+}
+
+__attribute__((target("avx512f")))
+inline void apply_matrix_avx512 (complex<double> *ket, int t, int c, const complex<double> m[4], size_t begin, size_t end) {
+  PairIndexer pair (t,c);
+  size_t tbit = size_t(1)<<t;
+  double *k = reinterpret_cast<double*>(ket);
+  if (t>=2){
+    __m512d m0r = _mm512_set1_pd(m[0].real()), m0i = _mm512_set1_pd(m[0].imag());
+    __m512d m1r = _mm512_set1_pd(m[1].real()), m1i = _mm512_set1_pd(m[1].imag());
+    __m512d m2r = _mm512_set1_pd(m[2].real()), m2i = _mm512_set1_pd(m[2].imag());
+    __m512d m3r = _mm512_set1_pd(m[3].real()), m3i = _mm512_set1_pd(m[3].imag());
+    for (size_t i=begin; i<end; i+=4){
+      size_t b0 = pair(i);
+      double *p0 = k + 2*b0;
+      double *p1 = k + 2*(b0|tbit);
+      __m512d e0 = _mm512_loadu_pd(p0);
+      __m512d e1 = _mm512_loadu_pd(p1);
+      // the zero masked forms keeping every lane are the same instruction, but unlike the plain forms they do not start from
+      // an undefined register, which gcc warns about with -Wall
+      __m512d s0 = _mm512_maskz_permute_pd(0xFF,e0,0x55);
+      __m512d s1 = _mm512_maskz_permute_pd(0xFF,e1,0x55);
+      _mm512_storeu_pd(p0, _mm512_fmadd_pd(e0, m0r, _mm512_fmaddsub_pd(e1, m1r, _mm512_fmadd_pd(s0, m0i, _mm512_mul_pd(s1, m1i)))));
+      _mm512_storeu_pd(p1, _mm512_fmadd_pd(e0, m2r, _mm512_fmaddsub_pd(e1, m3r, _mm512_fmadd_pd(s0, m2i, _mm512_mul_pd(s1, m3i)))));
+    }
+  } else {
+    // the register holds two pairs: {e0,e1,e0,e1} for t=0 and {e0,e0,e1,e1} for t=1
+    double d[2][8], o[2][8];
+    for (int j=0; j<4; j++){
+      bool one = (j>>t)&1;
+      complex<double> dj = one ? m[3] : m[0];
+      complex<double> oj = one ? m[2] : m[1];
+      d[0][2*j] = d[0][2*j+1] = dj.real();
+      d[1][2*j] = d[1][2*j+1] = dj.imag();
+      o[0][2*j] = o[0][2*j+1] = oj.real();
+      o[1][2*j] = o[1][2*j+1] = oj.imag();
+    }
+    __m512d dr = _mm512_loadu_pd(d[0]), di = _mm512_loadu_pd(d[1]);
+    __m512d or_ = _mm512_loadu_pd(o[0]), oi = _mm512_loadu_pd(o[1]);
+    for (size_t i=begin; i<end; i+=2){
+      double *p = k + 2*pair(i);
+      __m512d v = _mm512_loadu_pd(p);
+      __m512d w = (t==0) ? _mm512_maskz_shuffle_f64x2(0xFF,v,v,_MM_SHUFFLE(2,3,0,1)) : _mm512_maskz_shuffle_f64x2(0xFF,v,v,_MM_SHUFFLE(1,0,3,2));
+      __m512d sv = _mm512_maskz_permute_pd(0xFF,v,0x55);
+      __m512d sw = _mm512_maskz_permute_pd(0xFF,w,0x55);
+      _mm512_storeu_pd(p, _mm512_fmadd_pd(v, dr, _mm512_fmaddsub_pd(w, or_, _mm512_fmadd_pd(sv, di, _mm512_mul_pd(sw, oi)))));
+    }
+  }
+}
+
+// In single precision a register holds twice as many amplitudes: 4 (AVX2) or 8 (AVX-512).
+// Only the high case is vectorized, so gates on the lowest 2 or 3 qubits are left to the scalar kernel.
+
+__attribute__((target("avx2,fma")))
+inline void apply_matrix_avx2 (complex<float> *ket, int t, int c, const complex<double> m[4], size_t begin, size_t end) {
+  PairIndexer pair (t,c);
+  size_t tbit = size_t(1)<<t;
+  float *k = reinterpret_cast<float*>(ket);
+  __m256 m0r = _mm256_set1_ps(m[0].real()), m0i = _mm256_set1_ps(m[0].imag());
+  __m256 m1r = _mm256_set1_ps(m[1].real()), m1i = _mm256_set1_ps(m[1].imag());
+  __m256 m2r = _mm256_set1_ps(m[2].real()), m2i = _mm256_set1_ps(m[2].imag());
+  __m256 m3r = _mm256_set1_ps(m[3].real()), m3i = _mm256_set1_ps(m[3].imag());
+  for (size_t i=begin; i<end; i+=4){
+    size_t b0 = pair(i);
+    float *p0 = k + 2*b0;
+    float *p1 = k + 2*(b0|tbit);
+    __m256 e0 = _mm256_loadu_ps(p0);
+    __m256 e1 = _mm256_loadu_ps(p1);
+    __m256 s0 = _mm256_permute_ps(e0,0xb1);
+    __m256 s1 = _mm256_permute_ps(e1,0xb1);
+    _mm256_storeu_ps(p0, _mm256_fmadd_ps(e0, m0r, _mm256_fmaddsub_ps(e1, m1r, _mm256_fmadd_ps(s0, m0i, _mm256_mul_ps(s1, m1i)))));
+    _mm256_storeu_ps(p1, _mm256_fmadd_ps(e0, m2r, _mm256_fmaddsub_ps(e1, m3r, _mm256_fmadd_ps(s0, m2i, _mm256_mul_ps(s1, m3i)))));
+  }
+}
+
+__attribute__((target("avx512f")))
+inline void apply_matrix_avx512 (complex<float> *ket, int t, int c, const complex<double> m[4], size_t begin, size_t end) {
+  PairIndexer pair (t,c);
+  size_t tbit = size_t(1)<<t;
+  float *k = reinterpret_cast<float*>(ket);
+  __m512 m0r = _mm512_set1_ps(m[0].real()), m0i = _mm512_set1_ps(m[0].imag());
+  __m512 m1r = _mm512_set1_ps(m[1].real()), m1i = _mm512_set1_ps(m[1].imag());
+  __m512 m2r = _mm512_set1_ps(m[2].real()), m2i = _mm512_set1_ps(m[2].imag());
+  __m512 m3r = _mm512_set1_ps(m[3].real()), m3i = _mm512_set1_ps(m[3].imag());
+  for (size_t i=begin; i<end; i+=8){
+    size_t b0 = pair(i);
+    float *p0 = k + 2*b0;
+    float *p1 = k + 2*(b0|tbit);
+    __m512 e0 = _mm512_loadu_ps(p0);
+    __m512 e1 = _mm512_loadu_ps(p1);
+    // masked with every lane kept, as in apply_matrix_avx512
+    __m512 s0 = _mm512_maskz_permute_ps(0xFFFF,e0,0xb1);
+    __m512 s1 = _mm512_maskz_permute_ps(0xFFFF,e1,0xb1);
+    _mm512_storeu_ps(p0, _mm512_fmadd_ps(e0, m0r, _mm512_fmaddsub_ps(e1, m1r, _mm512_fmadd_ps(s0, m0i, _mm512_mul_ps(s1, m1i)))));
+    _mm512_storeu_ps(p1, _mm512_fmadd_ps(e0, m2r, _mm512_fmaddsub_ps(e1, m3r, _mm512_fmadd_ps(s0, m2i, _mm512_mul_ps(s1, m3i)))));
+  }
+}
+
+enum SimdLevel { SIMD_NONE, SIMD_AVX2, SIMD_AVX512 };
+
+inline SimdLevel detect_simd_level () {
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")){
+    return SIMD_AVX512;
+  }
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")){
+    return SIMD_AVX2;
+  }
+  return SIMD_NONE;
+}
+
+// The instruction set used by the kernels. It is detected on first use, and can be lowered (e.g. to compare with SIMD_NONE).
+inline SimdLevel &simd_level () {
+  static SimdLevel level = detect_simd_level();
+  return level;
+}
+#endif
+
+// Applies the matrix m to the given range of pairs, using the fastest kernel available for these qubits.
+inline void apply_matrix (complex<double> *ket, int t, int c, const complex<double> m[4], size_t begin, size_t end) {
+#ifdef MICROQISKIT_SIMD
+  // the number of pairs done per step by each kernel. the control must not be below the register width
+  int l = (c<0) ? t : min(c,t);
+  SimdLevel level = simd_level();
+  size_t step = 0;
+  if (level==SIMD_AVX512 && (c<0 || c>=2)){
+    step = (l>=2) ? 4 : 2;
+  } else if (level>=SIMD_AVX2 && c!=0){
+    level = SIMD_AVX2;
+    step = (l>=1) ? 2 : 1;
+  }
+  if (step>0){
+    // any pairs outside of whole steps are done by the scalar kernel
+    size_t first = min(end,(begin+step-1)/step*step);
+    size_t last = max(first,end/step*step);
+    apply_matrix_scalar(ket,t,c,m,begin,first);
+    if (level==SIMD_AVX512){
+      apply_matrix_avx512(ket,t,c,m,first,last);
+    } else {
+      apply_matrix_avx2(ket,t,c,m,first,last);
+    }
+    apply_matrix_scalar(ket,t,c,m,last,end);
+    return;
+  }
+#endif
+  apply_matrix_scalar(ket,t,c,m,begin,end);
+}
+
+inline void apply_matrix (complex<float> *ket, int t, int c, const complex<double> m[4], size_t begin, size_t end) {
+#ifdef MICROQISKIT_SIMD
+  // both qubits must be at or above the register width
+  int l = (c<0) ? t : min(c,t);
+  SimdLevel level = simd_level();
+  size_t step = 0;
+  if (level==SIMD_AVX512 && l>=3){
+    step = 8;
+  } else if (level>=SIMD_AVX2 && l>=2){
+    level = SIMD_AVX2;
+    step = 4;
+  }
+  if (step>0){
+    size_t first = min(end,(begin+step-1)/step*step);
+    size_t last = max(first,end/step*step);
+    apply_matrix_scalar(ket,t,c,m,begin,first);
+    if (level==SIMD_AVX512){
+      apply_matrix_avx512(ket,t,c,m,first,last);
+    } else {
+      apply_matrix_avx2(ket,t,c,m,first,last);
+    }
+    apply_matrix_scalar(ket,t,c,m,last,end);
+    return;
+  }
+#endif
+  apply_matrix_scalar(ket,t,c,m,begin,end);
+}
+
+// Applies a diagonal matrix {d0,0,0,d1} to the pairs numbered from begin to end, with the same arguments as apply_matrix.
+// The amplitudes are only multiplied, never mixed. Phase gates (with d0 = 1) only touch the half of the ket for which bit t is 1.
+template <typename R>
+inline void apply_diagonal (complex<R> *ket, int t, int c, complex<double> d0, complex<double> d1, size_t begin, size_t end) {
+  PairIndexer pair (t,c);
+  size_t tbit = size_t(1)<<t;
+  R d0r = d0.real(), d0i = d0.imag(), d1r = d1.real(), d1i = d1.imag();
+  bool phase = (d0==1.0);
+  for (size_t i=begin; i<end; i++){
+    size_t b0 = pair(i);
+    size_t b1 = b0|tbit;
+    if (!phase){
+      R e0r = ket[b0].real(), e0i = ket[b0].imag();
+      ket[b0] = complex<R>( d0r*e0r - d0i*e0i, d0r*e0i + d0i*e0r );
+    }
+    R e1r = ket[b1].real(), e1i = ket[b1].imag();
+    ket[b1] = complex<R>( d1r*e1r - d1i*e1i, d1r*e1i + d1i*e1r );
+  }
+}
+
+// Swaps the values of qubits q0 and q1 for the quads numbered from begin to end. This is a pure permutation of the amplitudes.
+template <typename R>
+inline void apply_swap (complex<R> *ket, int q0, int q1, size_t begin, size_t end) {
+  int l = min(q0,q1);
+  int h = max(q0,q1);
+  size_t bit0 = size_t(1)<<q0;
+  size_t bit1 = size_t(1)<<q1;
+  for (size_t i=begin; i<end; i++){
+    size_t b00 = insert_zero_bit(insert_zero_bit(i,l),h);
+    swap(ket[b00|bit0],ket[b00|bit1]);
+  }
+}
+
+// Applies a 4x4 matrix m (row major) to the quads of amplitudes numbered from begin to end, for the qubits q0 and q1.
+// Within a quad, amplitude j has bit q0 equal to bit 0 of j, and bit q1 equal to bit 1 of j.
+template <typename R>
+inline void apply_matrix4_scalar (complex<R> *ket, int q0, int q1, const complex<double> m[16], size_t begin, size_t end) {
+  int l = min(q0,q1);
+  int h = max(q0,q1);
+  size_t bit0 = size_t(1)<<q0;
+  size_t bit1 = size_t(1)<<q1;
+  // the products are written out in real arithmetic, as in apply_matrix_scalar
+  R mr[16], mi[16];
+  for (int j=0; j<16; j++){
+    mr[j] = m[j].real();
+    mi[j] = m[j].imag();
+  }
+  for (size_t i=begin; i<end; i++){
+    size_t b[4];
+    b[0] = insert_zero_bit(insert_zero_bit(i,l),h);
+    b[1] = b[0] | bit0;
+    b[2] = b[0] | bit1;
+    b[3] = b[1] | bit1;
+    R er[4], ei[4];
+    for (int j=0; j<4; j++){
+      er[j] = ket[b[j]].real();
+      ei[j] = ket[b[j]].imag();
+    }
+    for (int j=0; j<4; j++){
+      const R *r = mr+4*j;
+      const R *im = mi+4*j;
+      ket[b[j]] = complex<R>( r[0]*er[0] - im[0]*ei[0] + r[1]*er[1] - im[1]*ei[1] + r[2]*er[2] - im[2]*ei[2] + r[3]*er[3] - im[3]*ei[3],
+                                   r[0]*ei[0] + im[0]*er[0] + r[1]*ei[1] + im[1]*er[1] + r[2]*ei[2] + im[2]*er[2] + r[3]*ei[3] + im[3]*er[3] );
+    }
+  }
+}
+
+#ifdef MICROQISKIT_SIMD
+
+// As for the 2x2 kernels, these are for the high case, in which both qubits are above the register width.
+// Consecutive quads then have consecutive b0, so each of the four amplitudes of a quad is loaded from its own stripe.
+// Each output is the sum of e*mr over the inputs, combined with the sum of (e with re and im swapped)*mi by an addsub.
+// The matrix is broadcast once before the loop, since the compiler can't tell that the stores to the ket leave m unchanged.
+
+__attribute__((target("avx2,fma")))
+inline __m256d matrix4_row_avx2 (__m256d e0, __m256d e1, __m256d e2, __m256d e3, __m256d s0, __m256d s1, __m256d s2, __m256d s3, const __m256d *mr, const __m256d *mi) {
+  __m256d r = _mm256_fmadd_pd(e3, mr[3], _mm256_fmadd_pd(e2, mr[2], _mm256_fmadd_pd(e1, mr[1], _mm256_mul_pd(e0, mr[0]))));
+  __m256d im = _mm256_fmadd_pd(s3, mi[3], _mm256_fmadd_pd(s2, mi[2], _mm256_fmadd_pd(s1, mi[1], _mm256_mul_pd(s0, mi[0]))));
+  return _mm256_addsub_pd(r, im);
+}
+
+__attribute__((target("avx2,fma")))
+inline void apply_matrix4_avx2 (complex<double> *ket, int q0, int q1, const complex<double> m[16], size_t begin, size_t end) {
+  int l = min(q0,q1);
+  int h = max(q0,q1);
+  size_t bit0 = size_t(1)<<q0;
+  size_t bit1 = size_t(1)<<q1;
+  double *k = reinterpret_cast<double*>(ket);
+  __m256d mr[16], mi[16];
+  for (int j=0; j<16; j++){
+    mr[j] = _mm256_set1_pd(m[j].real());
+    mi[j] = _mm256_set1_pd(m[j].imag());
+  }
+  for (size_t i=begin; i<end; i+=2){
+    size_t b0 = insert_zero_bit(insert_zero_bit(i,l),h);
+    double *p0 = k + 2*b0;
+    double *p1 = k + 2*(b0|bit0);
+    double *p2 = k + 2*(b0|bit1);
+    double *p3 = k + 2*(b0|bit0|bit1);
+    __m256d e0 = _mm256_loadu_pd(p0), e1 = _mm256_loadu_pd(p1), e2 = _mm256_loadu_pd(p2), e3 = _mm256_loadu_pd(p3);
+    __m256d s0 = _mm256_permute_pd(e0,5), s1 = _mm256_permute_pd(e1,5), s2 = _mm256_permute_pd(e2,5), s3 = _mm256_permute_pd(e3,5);
+    _mm256_storeu_pd(p0, matrix4_row_avx2(e0,e1,e2,e3,s0,s1,s2,s3,mr,mi));
+    _mm256_storeu_pd(p1, matrix4_row_avx2(e0,e1,e2,e3,s0,s1,s2,s3,mr+4,mi+4));
+    _mm256_storeu_pd(p2, matrix4_row_avx2(e0,e1,e2,e3,s0,s1,s2,s3,mr+8,mi+8));
+    _mm256_storeu_pd(p3, matrix4_row_avx2(e0,e1,e2,e3,s0,s1,s2,s3,mr+12,mi+12));
+  }
+}
+
+__attribute__((target("avx512f")))
+inline __m512d matrix4_row_avx512 (__m512d e0, __m512d e1, __m512d e2, __m512d e3, __m512d s0, __m512d s1, __m512d s2, __m512d s3, const __m512d *mr, const __m512d *mi) {
+  __m512d r = _mm512_fmadd_pd(e3, mr[3], _mm512_fmadd_pd(e2, mr[2], _mm512_fmadd_pd(e1, mr[1], _mm512_mul_pd(e0, mr[0]))));
+  __m512d im = _mm512_fmadd_pd(s3, mi[3], _mm512_fmadd_pd(s2, mi[2], _mm512_fmadd_pd(s1, mi[1], _mm512_mul_pd(s0, mi[0]))));
+  // r*1 -/+ im, which is the addsub above
+  return _mm512_fmaddsub_pd(r, _mm512_set1_pd(1.0), im);
+}
+
+__attribute__((target("avx512f")))
+inline void apply_matrix4_avx512 (complex<double> *ket, int q0, int q1, const complex<double> m[16], size_t begin, size_t end) {
+  int l = min(q0,q1);
+  int h = max(q0,q1);
+  size_t bit0 = size_t(1)<<q0;
+  size_t bit1 = size_t(1)<<q1;
+  double *k = reinterpret_cast<double*>(ket);
+  __m512d mr[16], mi[16];
+  for (int j=0; j<16; j++){
+    mr[j] = _mm512_set1_pd(m[j].real());
+    mi[j] = _mm512_set1_pd(m[j].imag());
+  }
+  for (size_t i=begin; i<end; i+=4){
+    size_t b0 = insert_zero_bit(insert_zero_bit(i,l),h);
+    double *p0 = k + 2*b0;
+    double *p1 = k + 2*(b0|bit0);
+    double *p2 = k + 2*(b0|bit1);
+    double *p3 = k + 2*(b0|bit0|bit1);
+    __m512d e0 = _mm512_loadu_pd(p0), e1 = _mm512_loadu_pd(p1), e2 = _mm512_loadu_pd(p2), e3 = _mm512_loadu_pd(p3);
+    // masked with every lane kept, as in apply_matrix_avx512
+    __m512d s0 = _mm512_maskz_permute_pd(0xFF,e0,0x55), s1 = _mm512_maskz_permute_pd(0xFF,e1,0x55), s2 = _mm512_maskz_permute_pd(0xFF,e2,0x55), s3 = _mm512_maskz_permute_pd(0xFF,e3,0x55);
+    _mm512_storeu_pd(p0, matrix4_row_avx512(e0,e1,e2,e3,s0,s1,s2,s3,mr,mi));
+    _mm512_storeu_pd(p1, matrix4_row_avx512(e0,e1,e2,e3,s0,s1,s2,s3,mr+4,mi+4));
+    _mm512_storeu_pd(p2, matrix4_row_avx512(e0,e1,e2,e3,s0,s1,s2,s3,mr+8,mi+8));
+    _mm512_storeu_pd(p3, matrix4_row_avx512(e0,e1,e2,e3,s0,s1,s2,s3,mr+12,mi+12));
+  }
+}
+
+#endif
+
+// Applies the 4x4 matrix m to the given range of quads, using the fastest kernel available for these qubits.
+inline void apply_matrix4 (complex<double> *ket, int q0, int q1, const complex<double> m[16], size_t begin, size_t end) {
+#ifdef MICROQISKIT_SIMD
+  int l = min(q0,q1);
+  SimdLevel level = simd_level();
+  size_t step = 0;
+  if (level==SIMD_AVX512 && l>=2){
+    step = 4;
+  } else if (level>=SIMD_AVX2 && l>=1){
+    level = SIMD_AVX2;
+    step = 2;
+  }
+  if (step>0){
+    size_t first = min(end,(begin+step-1)/step*step);
+    size_t last = max(first,end/step*step);
+    apply_matrix4_scalar(ket,q0,q1,m,begin,first);
+    if (level==SIMD_AVX512){
+      apply_matrix4_avx512(ket,q0,q1,m,first,last);
+    } else {
+      apply_matrix4_avx2(ket,q0,q1,m,first,last);
+    }
+    apply_matrix4_scalar(ket,q0,q1,m,last,end);
+    return;
+  }
+#endif
+  apply_matrix4_scalar(ket,q0,q1,m,begin,end);
+}
+
+inline void apply_matrix4 (complex<float> *ket, int q0, int q1, const complex<double> m[16], size_t begin, size_t end) {
+  apply_matrix4_scalar(ket,q0,q1,m,begin,end);
+}
+
+// A fixed set of worker threads, kept alive between gates so that starting each gate costs only a wake up.
+// run() splits a range of work items into one chunk per thread, with the calling thread doing the first chunk.
+class WorkerPool {
+
+  public:
+
+    WorkerPool (int n) {
+      if (n<1){
+        ERROR("WorkerPool: The number of threads must be at least 1");
+      }
+      nThreads = n;
+      generation = 0;
+      finished = 0;
+      stopping = false;
+      for (int w=1; w<nThreads; w++){
+        workers.push_back( thread(&WorkerPool::work, this, w) );
+      }
+    }
+
+    ~WorkerPool () {
+      {
+        lock_guard<mutex> lock(m);
+        stopping = true;
+      }
+      start.notify_all();
+      for (int w=0; w<workers.size(); w++){
+        workers[w].join();
+      }
+    }
+
+    int size () const {
+      return nThreads;
+    }
+
+    // Calls f(begin,end) on chunks that cover items 0 to count, and returns once all are done.
+    // Chunks start on multiples of align, so that every item is handled by the same kernel code as in a single call.
+    void run (size_t count, size_t align, const function<void(size_t,size_t)> &f) {
+      run_indexed(count, align, [&f](int, size_t begin, size_t end){ f(begin,end); });
+    }
+
+    // As run, but f is also given the number of the thread (from 0 to size()-1), for example to pick a buffer to work in.
+    void run_indexed (size_t count, size_t align, const function<void(int,size_t,size_t)> &f) {
+      size_t chunk = (count+nThreads-1)/nThreads;
+      chunk = (chunk+align-1)/align*align;
+      {
+        lock_guard<mutex> lock(m);
+        task = &f;
+        taskCount = count;
+        taskChunk = chunk;
+        finished = 0;
+        generation++;
+      }
+      start.notify_all();
+      f(0,0,min(count,chunk));
+      unique_lock<mutex> lock(m);
+      done.wait(lock, [this]{ return finished==nThreads-1; });
+    }
+
+  private:
+
+    int nThreads;
+    vector<thread> workers;
+    mutex m;
+    condition_variable start, done;
+    const function<void(int,size_t,size_t)> *task;
+    size_t taskCount, taskChunk;
+    unsigned long generation;
+    int finished;
+    bool stopping;
+
+    void work (int w) {
+      unsigned long seen = 0;
+      while (true) {
+        const function<void(int,size_t,size_t)> *f;
+        size_t begin, end;
+        {
+          unique_lock<mutex> lock(m);
+          start.wait(lock, [&]{ return stopping || generation!=seen; });
+          if (stopping){
+            return;
+          }
+          seen = generation;
+          f = task;
+          begin = min(taskCount,w*taskChunk);
+          end = min(taskCount,(w+1)*taskChunk);
+        }
+        if (begin<end){
+          (*f)(w,begin,end);
+        }
+        {
+          lock_guard<mutex> lock(m);
+          finished++;
+        }
+        done.notify_one();
+      }
+    }
+
+};
+
 class QuantumCircuit {
 
   public:
 
+    // gates are stored as a compact typed instruction stream, as in the Arduino version, rather than as lists of strings
+    enum GateOp { INIT, X, RX, RZ, RY, H, Z, Y, U, CX, CH, CRX, CRZ, SWAP, M, RST }; // RST is reset, since RESET is taken by the colour macro above
+
+    struct Op {
+      GateOp gate;
+      double angle; // for U this is theta. unused if there is a parameter
+      int control; // for single qubit gates this is unused. for INIT it is the number of doubles, for U the offset of phi and lambda in op_data, for M it is the qubit
+      int target; // for INIT it is the offset of the doubles in op_data, for M it is the bit
+      int param; // the parameter that gives the angle, or -1 if it is fixed
+      int cbit; // the classical bit that the gate is conditioned on, or -1 if it always runs
+      int cvalue; // the value that cbit must have for the gate to run
+
+      Op(GateOp g = INIT, double a = 0.0, int q1 = 0, int q2 = 0, int p = -1) : gate(g), angle(a), control(q1), target(q2), param(p), cbit(-1), cvalue(0) {}
+    };
+
+    // A symbolic angle, made by parameter(). Gates can be given one instead of a number, and its value is set later with bind().
+    struct Parameter {
+      int index;
+    };
+
     int nQubits, nBits;
-    vector<vector<string>> data;
+    vector<Op> data;
+    vector<double> op_data; // the doubles given to initialize and the extra angles of u gates, referenced by their ops
+    vector<string> param_names;
+    vector<double> param_values; // the bound value of each parameter, 0 until bind() is used
     
     QuantumCircuit (){
 
@@ -55,85 +680,138 @@ class QuantumCircuit {
       }
     }
 
-    void add (QuantumCircuit qc2) {
+    void add (const QuantumCircuit &qc2) {
 
+      if (&qc2==this){
+        // a vector cannot have its own elements inserted into it, so adding a circuit to itself goes through a copy
+        QuantumCircuit copy = qc2;
+        add(copy);
+        return;
+      }
       nBits = max(nBits,qc2.nBits);
       nQubits = max(nQubits,qc2.nQubits);
-      for (int g=0; g<qc2.data.size(); g++){ 
-        data.push_back( qc2.data[g] );
+      int offset = op_data.size();
+      op_data.insert(op_data.end(), qc2.op_data.begin(), qc2.op_data.end());
+      size_t first = data.size();
+      data.insert(data.end(), qc2.data.begin(), qc2.data.end());
+      // parameters with the same name are the same parameter, and keep the value bound here. the others are added with
+      // the value bound in qc2
+      vector<int> params (qc2.param_names.size());
+      bool renumbered = false;
+      for (int j=0; j<params.size(); j++){
+        int existing = param_names.size();
+        params[j] = parameter(qc2.param_names[j]).index;
+        if (params[j]>=existing){
+          param_values[params[j]] = qc2.param_values[j];
+        }
+        renumbered = renumbered || (params[j]!=j);
+      }
+      // only the ops that refer to op_data or parameters need changing
+      if (offset>0 || renumbered){
+        for (size_t g=first; g<data.size(); g++){
+          if (data[g].gate==INIT){
+            data[g].target += offset;
+          } else if (data[g].gate==U){
+            data[g].control += offset;
+          }
+          if (data[g].param>=0){
+            data[g].param = params[data[g].param];
+          }
+        }
+      }
+    }
+
+    // Gives the parameter with the given name, which is created if there is not one already.
+    Parameter parameter (string name) {
+      Parameter p;
+      for (p.index=0; p.index<param_names.size(); p.index++){
+        if (param_names[p.index]==name){
+          return p;
+        }
+      }
+      param_names.push_back(name);
+      param_values.push_back(0.0);
+      return p;
+    }
+
+    // Sets the values of all parameters, in the order they were made. The gates themselves are untouched, so this is cheap.
+    void bind (const vector<double> &values) {
+      if (values.size()!=param_values.size()){
+        ERROR("bind: Expected "+to_string(param_values.size())+" parameter values, but got "+to_string(values.size()));
+      }
+      param_values = values;
+    }
+
+    // The angle of an op, taking its parameter into account.
+    double angle (const Op &op) const {
+      return (op.param>=0) ? param_values[op.param] : op.angle;
+    }
+
+    // True if gate g of this circuit does the same as gate h of other. Angles and the data of initialize are compared by
+    // value, rather than by where they are stored.
+    bool same_gate (size_t g, const QuantumCircuit &other, size_t h) const {
+      const Op &a = data[g], &b = other.data[h];
+      if (a.gate!=b.gate || a.target!=b.target || a.cbit!=b.cbit || a.cvalue!=b.cvalue || angle(a)!=other.angle(b)){
+        return false;
+      }
+      if (a.gate==U){
+        return op_data[a.control]==other.op_data[b.control] && op_data[a.control+1]==other.op_data[b.control+1];
+      }
+      if (a.gate==INIT){
+        return a.control==b.control && equal(op_data.begin()+a.target, op_data.begin()+a.target+a.control, other.op_data.begin()+b.target);
       }
+      return a.control==b.control;
     }
 
     void initialize (vector<double> p){
-      vector<string> init;
       //verify if the size of double vector is correct
       int t = pow(2, nQubits);
       if( !(p.size()==t||p.size()==t*2) ){
         ERROR("initialize: Can't initialize circuit. Please insert a vector {} with either "+to_string(t)+" or "+to_string(t*2)+" doubles");
       }
       data.clear();
-      init.push_back("init");
-      init.push_back(to_string(p.size()));
-      for(int i=0;i<p.size();i++){
-        init.push_back(to_string(p[i]));
-      }
-      data.push_back(init);
+      op_data = p;
+      data.push_back( Op(INIT, 0.0, p.size(), 0) );
     }
     void x (int q) {
-      vector<string> gate;
       verify_qubit_range(q,"x gate");
-      gate.push_back("x");
-      gate.push_back(to_string(q));
-      data.push_back(gate);
+      data.push_back( Op(X, 0.0, 0, q) );
     }
     void rx (double theta, int q) {
-      vector<string> gate;
       verify_qubit_range(q,"rx gate");
-      gate.push_back("rx");
-      gate.push_back(to_string(theta));
-      gate.push_back(to_string(q));
-      data.push_back(gate);
+      data.push_back( Op(RX, theta, 0, q) );
+    }
+    void rx (Parameter theta, int q) {
+      verify_qubit_range(q,"rx gate");
+      data.push_back( Op(RX, 0.0, 0, q, theta.index) );
     }
     void h (int q) {
-      std::cout<<"hello from header"<<std::endl;
-      vector<string> gate;
       verify_qubit_range(q,"h gate");
-      gate.push_back("h");
-      gate.push_back(to_string(q));
-      data.push_back(gate);
+      data.push_back( Op(H, 0.0, 0, q) );
     }
     void cx (int s, int t) { 
-      vector<string> gate;
       verify_qubit_range(s,"cx gate");
       verify_qubit_range(t,"cx gate");
-      gate.push_back("cx");
-      gate.push_back(to_string(s));
-      gate.push_back(to_string(t));
-      data.push_back(gate);
+      data.push_back( Op(CX, 0.0, s, t) );
     }
     //new ch gate
     void ch (int s, int t) { 
-      vector<string> gate;
       verify_qubit_range(s,"ch gate");
       verify_qubit_range(t,"ch gate");
-      gate.push_back("ch");
-      gate.push_back(to_string(s));
-      gate.push_back(to_string(t));
-      data.push_back(gate);
+      data.push_back( Op(CH, 0.0, s, t) );
     }
     //new crx gate
     void crx (double theta, int s, int t) { 
-      vector<string> gate;
       verify_qubit_range(s,"crx gate");
       verify_qubit_range(t,"crx gate");
-      gate.push_back("crx");
-      gate.push_back(to_string(theta));
-      gate.push_back(to_string(s));
-      gate.push_back(to_string(t));
-      data.push_back(gate);
+      data.push_back( Op(CRX, theta, s, t) );
+    }
+    void crx (Parameter theta, int s, int t) { 
+      verify_qubit_range(s,"crx gate");
+      verify_qubit_range(t,"crx gate");
+      data.push_back( Op(CRX, 0.0, s, t, theta.index) );
     }
     void measure (int q, int b) {
-      vector<string> gate;
       if(!(q==b) )
       {
         ERROR("It is only possible to add measure gates of the form measure(j,j) in MicroQiskit");
@@ -141,57 +819,107 @@ class QuantumCircuit {
       verify_qubit_range(q,"measure gate");
       verify_bit_range(b,"measure gate");
 
-      gate.push_back("m");
-      gate.push_back(to_string(b));
-      gate.push_back(to_string(q));
-      data.push_back(gate);
+      data.push_back( Op(M, 0.0, q, b) );
     }
+    // unlike the Python version, these gates are simulated directly rather than being built from others
     void rz (double theta, int q) {
       verify_qubit_range(q,"rz gate");
-      h(q);
-      rx(theta,q);
-      h(q);
+      data.push_back( Op(RZ, theta, 0, q) );
+    }
+    void rz (Parameter theta, int q) {
+      verify_qubit_range(q,"rz gate");
+      data.push_back( Op(RZ, 0.0, 0, q, theta.index) );
     }
     void ry (double theta, int q) {
       verify_qubit_range(q,"ry gate");
-      rx(M_PI/2,q);
-      h(q);
-      rx(theta,q);
-      h(q);
-      rx(-M_PI/2,q);
+      data.push_back( Op(RY, theta, 0, q) );
+    }
+    void ry (Parameter theta, int q) {
+      verify_qubit_range(q,"ry gate");
+      data.push_back( Op(RY, 0.0, 0, q, theta.index) );
     }
     void z ( int q) {
       verify_qubit_range(q,"z gate");
-      rz(M_PI,q);
+      data.push_back( Op(Z, 0.0, 0, q) );
     }
     void y ( int q) {
       verify_qubit_range(q,"y gate");
-      z(q);
-      x(q);
+      data.push_back( Op(Y, 0.0, 0, q) );
+    }
+    // the general single qubit gate, as in Qiskit
+    void u (double theta, double phi, double lambda, int q) {
+      verify_qubit_range(q,"u gate");
+      data.push_back( Op(U, theta, op_data.size(), q) );
+      op_data.push_back(phi);
+      op_data.push_back(lambda);
+    }
+    void crz (double theta, int s, int t) { 
+      verify_qubit_range(s,"crz gate");
+      verify_qubit_range(t,"crz gate");
+      data.push_back( Op(CRZ, theta, s, t) );
+    }
+    void crz (Parameter theta, int s, int t) { 
+      verify_qubit_range(s,"crz gate");
+      verify_qubit_range(t,"crz gate");
+      data.push_back( Op(CRZ, 0.0, s, t, theta.index) );
+    }
+    void swap (int s, int t) { 
+      verify_qubit_range(s,"swap gate");
+      verify_qubit_range(t,"swap gate");
+      data.push_back( Op(SWAP, 0.0, s, t) );
+    }
+    // puts the qubit back to |0>, by measuring it and flipping it if the outcome was 1
+    void reset (int q) {
+      verify_qubit_range(q,"reset");
+      data.push_back( Op(RST, 0.0, q, 0) );
+    }
+    // makes the last gate added run only when the given bit holds the value, as with c_if in Qiskit
+    void c_if (int b, int value) {
+      verify_bit_range(b,"c_if");
+      if (data.empty() || data.back().gate==INIT || data.back().gate==M || data.back().gate==RST){
+        ERROR("c_if: Only gates can be conditioned on a bit");
+      }
+      if (!(value==0 || value==1)){
+        ERROR("c_if: The value of a bit must be 0 or 1");
+      }
+      data.back().cbit = b;
+      data.back().cvalue = value;
+    }
+
+    // True if the circuit needs measurement to happen as it runs: it has a reset, a conditioned gate, or a gate after a measure.
+    bool is_dynamic() const {
+      bool measured = false;
+      for (size_t g=0; g<data.size(); g++){
+        if (data[g].gate==RST || data[g].cbit>=0 || (measured && data[g].gate!=M)){
+          return true;
+        }
+        measured = measured || data[g].gate==M;
+      }
+      return false;
     }
 
-    bool has_measurements(){
+    bool has_measurements() const {
       //this is not totally bulletproof. i.e. it doesn't care where in time you actually place the gates :/
-      vector<int> mGates;
-      map<int,int> mUnique;
-      map<int,int>::iterator it;
-      //check all gates in circuit
+      if (nQubits<=64){
+        //a bit mask is enough for anything that could be simulated, and saves allocating on every query
+        unsigned long long marked = 0;
+        for (int g=0; g<data.size(); g++){
+          if (data[g].gate==M && data[g].control<nQubits){
+            marked |= 1ULL<<data[g].control;
+          }
+        }
+        return marked==((nQubits==64) ? ~0ULL : (1ULL<<nQubits)-1);
+      }
+      vector<bool> measured (nQubits,false);
+      //check all gates in circuit, and mark the qubit of each measure gate
       for (int g=0; g<data.size(); g++){
-        //collect all measure gates in mGates
-        if (data[g][0]=="m"){
-          //just need the qubit they are assigned to
-          mGates.push_back( stoi(data[g][1]) );
+        if (data[g].gate==M && data[g].control<nQubits){
+          measured[data[g].control] = true;
         }
       }
       //a full set of measurement gates must have a measure gate on each qubit in the circuit
-      //create a list of all unique measure-gated qubits
-      for(int num : mGates){
-        mUnique[mGates[num]]=1;
-      }
-      //check if we have a measure gate for each qubit
       for(int i=0; i<nQubits; i++){
-        it = mUnique.find(i);
-        if(it == mUnique.end()){
+        if(!measured[i]){
           return false;
         }
       }
@@ -217,281 +945,3527 @@ class QuantumCircuit {
 
 };
 
-class Simulator {
-  // Contains methods required to simulate a circuit and provide the desired outputs.
+// Writes a double with the fewest digits (up to 17) that read back exactly, so that angles are not rounded as with to_string.
+inline string number_string (double x) {
+  char buffer[32];
+  for (int digits=6; digits<=17; digits++){
+    snprintf(buffer, sizeof(buffer), "%.*g", digits, x);
+    if (strtod(buffer,NULL)==x){
+      break;
+    }
+  }
+  return buffer;
+}
+
+// Gives the 2x2 matrix applied to the target by a gate (or by a controlled gate where the control is 1).
+// The angle is the same for every pair, so the trigonometry is done once per gate.
+inline void gate_matrix (const QuantumCircuit &qc, const QuantumCircuit::Op &op, complex<double> m[4]) {
+  double theta = qc.angle(op);
+  double c = cos(theta/2);
+  double s = sin(theta/2);
+  switch (op.gate){
+    case QuantumCircuit::X:
+    case QuantumCircuit::CX:
+      m[0] = 0.0; m[1] = 1.0;
+      m[2] = 1.0; m[3] = 0.0;
+      break;
+    case QuantumCircuit::H:
+    case QuantumCircuit::CH:
+      m[0] = M_SQRT1_2; m[1] = M_SQRT1_2;
+      m[2] = M_SQRT1_2; m[3] = -M_SQRT1_2;
+      break;
+    case QuantumCircuit::RZ:
+    case QuantumCircuit::CRZ:
+      // e^(-i theta/2)*e0 and e^(i theta/2)*e1
+      m[0] = complex<double>(c,-s); m[1] = 0.0;
+      m[2] = 0.0; m[3] = complex<double>(c,s);
+      break;
+    case QuantumCircuit::RY:
+      m[0] = c; m[1] = -s;
+      m[2] = s; m[3] = c;
+      break;
+    case QuantumCircuit::Z:
+      m[0] = 1.0; m[1] = 0.0;
+      m[2] = 0.0; m[3] = -1.0;
+      break;
+    case QuantumCircuit::Y:
+      m[0] = 0.0; m[1] = complex<double>(0.0,-1.0);
+      m[2] = complex<double>(0.0,1.0); m[3] = 0.0;
+      break;
+    case QuantumCircuit::U: {
+      double phi = qc.op_data[op.control];
+      double lambda = qc.op_data[op.control+1];
+      m[0] = c; m[1] = -polar(s,lambda);
+      m[2] = polar(s,phi); m[3] = polar(c,phi+lambda);
+      break;
+    }
+    default:
+      // cos(theta/2)*e0 - i*sin(theta/2)*e1, and vice versa
+      m[0] = c; m[1] = complex<double>(0.0,-s);
+      m[2] = complex<double>(0.0,-s); m[3] = c;
+  }
+}
 
-  vector<vector<double>> simulate (QuantumCircuit qc) {
+inline bool is_controlled (QuantumCircuit::GateOp gate) {
+  return gate==QuantumCircuit::CX || gate==QuantumCircuit::CH || gate==QuantumCircuit::CRX || gate==QuantumCircuit::CRZ;
+}
 
-    vector<vector<double>> ket;
+// A gate of the circuit after fusion, which is what the simulator actually applies.
+// SINGLE applies the 2x2 matrix m to q0. CONTROLLED applies it to q0 where q1 is 1. PAIR applies the 4x4 matrix m to q0 and q1.
+// SWAP exchanges q0 and q1, and needs no matrix. INIT refers back to the INIT op of the circuit, numbered by q0.
+struct FusedGate {
+  enum Kind { INIT, SINGLE, CONTROLLED, SWAP, PAIR };
+  Kind kind;
+  int q0, q1;
+  complex<double> m[16];
+};
 
-    // initializing the internal ket
-    for (int j=0; j<pow(2,qc.nQubits); j++){
-      vector<double> e;
-      for (int k=0; k<2; k++){
-        e.push_back(0.0);
+// Sets c = a*b for n by n matrices.
+inline void matrix_product (const complex<double> *a, const complex<double> *b, complex<double> *c, int n) {
+  for (int i=0; i<n; i++){
+    for (int j=0; j<n; j++){
+      complex<double> sum = 0.0;
+      for (int k=0; k<n; k++){
+        sum += a[n*i+k]*b[n*k+j];
       }
-      ket.push_back(e); //add vector{0.0, 0.0}
-    }//e.g. for 2 qubits < <0.0, 0.0> <0.0, 0.0> <0.0, 0.0> <0.0, 0.0> >
-    ket[0][0] = 1.0; //change the first number on the first vector in ket. this means that by default it will be measuring 0, because that's the first bitstr.
-    //e.g. < <1.0, 0.0> <0.0, 0.0> <0.0, 0.0> <0.0, 0.0> >
+      c[n*i+j] = sum;
+    }
+  }
+}
 
-    //for each gate in qc.data vector (a vetor which is of the type vector<vector<string>>) there is an added vector<string>. Thus, qc.data.size() = the number of gates in qc.
-    for (int g=0; g<qc.data.size(); g++){
+// Writes the 4x4 matrix of the gate g in the basis of the pair of qubits p, which must act on the same qubits.
+// m may be g.m itself.
+inline void pair_matrix (const FusedGate &g, const FusedGate &p, complex<double> m[16]) {
+  complex<double> gm[16];
+  copy(g.m,g.m+16,gm);
+  if (g.kind==FusedGate::PAIR){
+    // the local bits are exchanged if the qubits are in the other order
+    const int order[2][4] = {{0,1,2,3},{0,2,1,3}};
+    const int *o = order[g.q0!=p.q0];
+    for (int j=0; j<4; j++){
+      for (int k=0; k<4; k++){
+        m[4*j+k] = gm[4*o[j]+o[k]];
+      }
+    }
+    return;
+  }
+  if (g.kind==FusedGate::SWAP){
+    for (int j=0; j<4; j++){
+      for (int k=0; k<4; k++){
+        // local bits 01 and 10 are exchanged
+        int swapped = (k==1 || k==2) ? 3-k : k;
+        m[4*j+k] = (j==swapped) ? 1.0 : 0.0;
+      }
+    }
+    return;
+  }
+  // the local bits of the target and (for controlled gates) the control
+  int t = (g.q0==p.q0) ? 0 : 1;
+  int c = 1-t;
+  for (int j=0; j<4; j++){
+    for (int k=0; k<4; k++){
+      complex<double> v = 0.0;
+      if (g.kind==FusedGate::CONTROLLED && !((j>>c)&1)){
+        v = (j==k) ? 1.0 : 0.0;
+      } else if (((j>>c)&1)==((k>>c)&1)){
+        v = gm[2*((j>>t)&1)+((k>>t)&1)];
+      }
+      m[4*j+k] = v;
+    }
+  }
+}
 
-      if ( (qc.data[g][0]=="init") ){
-        // initialize
-        int initsize = stoi(qc.data[g][1]);
-        for(int i=0; i<initsize; i++){
-          if(initsize==pow(2,qc.nQubits)){
-            //if just a simple list
-            ket[i][0] = stod(qc.data[g][2+i]);
-            ket[i][1] = 0.0;
-          } else {
-            //else it must be a complete list
-            ket[i/2][i%2] = stod(qc.data[g][2+i]);
-          }
-        }
-      } else if ( (qc.data[g][0]=="x") or (qc.data[g][0]=="rx") or (qc.data[g][0]=="h") ) {
-
-        int q;
-        q = stoi( qc.data[g][qc.data[g].size()-1] );
-        //retrieve the last qubit number from the gate vector (target) as an int, e.g. <"h","0"> = 0
-
-        for (int i0=0; i0<pow(2,q); i0++){
-          for (int i1=0; i1<pow(2,qc.nQubits-q-1); i1++){
-            int b0,b1;
-            b0 = i0 + int(pow(2,q+1)) * i1;
-            b1 = b0 + int(pow(2,q));
-
-            vector<double> e0, e1;
-            e0 = ket[b0];
-            e1 = ket[b1];
-
-            if (qc.data[g][0]=="x"){
-              ket[b0] = e1;
-              ket[b1] = e0;
-            } else if (qc.data[g][0]=="rx"){
-              double theta = stof( qc.data[g][1] );
-              ket[b0][0] = e0[0]*cos(theta/2)+e1[1]*sin(theta/2);
-              ket[b0][1] = e0[1]*cos(theta/2)-e1[0]*sin(theta/2);
-              ket[b1][0] = e1[0]*cos(theta/2)+e0[1]*sin(theta/2);
-              ket[b1][1] = e1[1]*cos(theta/2)-e0[0]*sin(theta/2);
-            } else if (qc.data[g][0]=="h"){
-              for (int k=0; k<2; k++){
-                ket[b0][k] = (e0[k] + e1[k])/sqrt(2);
-                ket[b1][k] = (e0[k] - e1[k])/sqrt(2);
-              }
-            }
+// Converts a single gate to a FusedGate, without merging it with anything.
+inline void op_gate (const QuantumCircuit &qc, const QuantumCircuit::Op &op, FusedGate &gate) {
+  gate.q0 = op.target;
+  if (op.gate==QuantumCircuit::SWAP){
+    gate.kind = FusedGate::SWAP;
+    gate.q1 = op.control;
+  } else {
+    gate_matrix(qc,op,gate.m);
+    gate.kind = is_controlled(op.gate) ? FusedGate::CONTROLLED : FusedGate::SINGLE;
+    gate.q1 = is_controlled(op.gate) ? op.control : -1;
+  }
+}
 
-          }
-        }
+// Raises an error for a circuit that measures as it runs (see QuantumCircuit::is_dynamic), which only Simulator's counts
+// and memory can simulate. Elsewhere a measure followed by more gates would otherwise be treated as one at the end.
+inline void verify_static (const QuantumCircuit &qc, const string &name) {
+  if (qc.is_dynamic()){
+    ERROR(name+": The circuit measures as it runs, which only get_counts and get_memory of a Simulator support");
+  }
+}
 
-      } else if ( (qc.data[g][0]=="cx") or (qc.data[g][0]=="ch") or (qc.data[g][0]=="crx") ) {
-        int s,t,l,h;
-        s = stoi( qc.data[g][qc.data[g].size()-2] );
-        t = stoi( qc.data[g][qc.data[g].size()-1] );
-        if (s>t){
-          h = s;
-          l = t;
-        } else {
-          h = t;
-          l = s;
-        }
-
-        for (int i0=0; i0<pow(2,l); i0++){
-          for (int i1=0; i1<pow(2,h-l-1); i1++){
-            for (int i2=0; i2<pow(2,qc.nQubits-h-1); i2++){
-              int b0,b1;
-              b0 = i0 + pow(2,l+1)*i1 + pow(2,h+1)*i2 + pow(2,s);
-              b1 = b0 + pow(2,t);
-
-              vector<double> e0, e1;
-              e0 = ket[b0];
-              e1 = ket[b1];
-
-              if (qc.data[g][0]=="cx"){
-                ket[b0] = e1;
-                ket[b1] = e0;
-              } else if (qc.data[g][0]=="ch"){
-                for (int k=0; k<2; k++){
-                  ket[b0][k] = (e0[k] + e1[k])/sqrt(2);
-                  ket[b1][k] = (e0[k] - e1[k])/sqrt(2);
-                }
-              } else if (qc.data[g][0]=="crx"){
-                double theta = stof( qc.data[g][1] );
-                ket[b0][0] = e0[0]*cos(theta/2)+e1[1]*sin(theta/2);
-                ket[b0][1] = e0[1]*cos(theta/2)-e1[0]*sin(theta/2);
-                ket[b1][0] = e1[0]*cos(theta/2)+e0[1]*sin(theta/2);
-                ket[b1][1] = e1[1]*cos(theta/2)-e0[0]*sin(theta/2);
-              }
-              
-            }
-          }
-        }
-      }
+// Gives one more than the number of the last initialize in the circuit, or 0 if there is none.
+// Since an initialize sets the whole state, the gates before it make no difference.
+inline size_t last_init (const QuantumCircuit &qc) {
+  size_t g = qc.data.size();
+  while (g>0 && qc.data[g-1].gate!=QuantumCircuit::INIT){
+    g--;
+  }
+  return g;
+}
 
-    }
+// Merges the gates of a circuit into fewer, more general gates, since each one applied costs a full sweep of the ket.
+// Runs of single qubit gates on a qubit become one 2x2 matrix, which is held back until the qubit is next used.
+// A two qubit gate absorbs the held back matrices of its qubits, and any later gates on the same qubits that come
+// before either qubit is used elsewhere, by becoming a general 4x4 matrix.
+// If merge is false, each gate is simply converted to its matrix. Only the gates from number first up to (but not including)
+// number end are included, which by default is all that follow first.
+inline void fuse_gates (const QuantumCircuit &qc, vector<FusedGate> &fused, bool merge = true, size_t first = 0, size_t end = size_t(-1)) {
 
-    return ket;
-  }
+  fused.clear();
+  // pending[q] is the index in fused of the held back single qubit gate on q, and last[q] the two qubit gate that q was last used in
+  // these are fixed arrays, since no ket of more than 64 qubits could be indexed anyway
+  int pending[64], last[64];
+  fill(pending,pending+64,-1);
+  fill(last,last+64,-1);
 
-  vector<double> get_probs (QuantumCircuit qc) {
+  end = min(end, qc.data.size());
+  for (size_t g=first; g<end; g++){
 
-    if(!qc.has_measurements()){
-      ERROR("get_probs: The circuit should have a full set of measure gates");
+    const QuantumCircuit::Op &op = qc.data[g];
+
+    if (op.gate==QuantumCircuit::M){
+      continue;
+    }
+
+    FusedGate gate;
+    if (op.gate==QuantumCircuit::INIT){
+      // nothing can be moved past an initialize
+      fused.push_back(gate);
+      for (int q=0; q<qc.nQubits; q++){
+        pending[q] = last[q] = -1;
+      }
+      fused.back().kind = FusedGate::INIT;
+      fused.back().q0 = g;
+      continue;
     }
 
-    vector<vector<double>> ket;
-    ket = simulate(qc);
+    if (op.gate==QuantumCircuit::RST || op.cbit>=0){
+      ERROR("fuse_gates: Resets and conditioned gates depend on measurement, and so can only be run by get_counts or get_memory of a Simulator");
+    }
+    op_gate(qc,op,gate);
+    if (!merge){
+      fused.push_back(gate);
+      continue;
+    }
+    complex<double> m[16];
 
-    vector<double> probs;
-    for (int j=0; j<ket.size(); j++){
+    if (gate.kind==FusedGate::SINGLE){
+      int q = op.target;
+      if (pending[q]>=0){
+        FusedGate &p = fused[pending[q]];
+        matrix_product(gate.m,p.m,m,2);
+        copy(m,m+4,p.m);
+      } else if (last[q]>=0){
+        FusedGate &p = fused[last[q]];
+        if (p.kind!=FusedGate::PAIR){
+          pair_matrix(p,p,p.m);
+          p.kind = FusedGate::PAIR;
+        }
+        complex<double> g4[16];
+        pair_matrix(gate,p,g4);
+        matrix_product(g4,p.m,m,4);
+        copy(m,m+16,p.m);
+      } else {
+        pending[q] = fused.size();
+        fused.push_back(gate);
+      }
+      continue;
+    }
 
-      probs.push_back( pow(ket[j][0],2) + pow(ket[j][1],2) );
+    int s = op.control;
+    int t = op.target;
+    if (last[s]>=0 && last[s]==last[t]){
+      // the previous two qubit gate was on the same qubits, and so they are merged
+      FusedGate &p = fused[last[t]];
+      if (gate.kind==FusedGate::CONTROLLED && p.kind==FusedGate::CONTROLLED && p.q0==t){
+        // controlled gates with the same control just multiply their 2x2 matrices
+        matrix_product(gate.m,p.m,m,2);
+        copy(m,m+4,p.m);
+      } else {
+        if (p.kind!=FusedGate::PAIR){
+          pair_matrix(p,p,p.m);
+          p.kind = FusedGate::PAIR;
+        }
+        complex<double> g4[16];
+        pair_matrix(gate,p,g4);
+        matrix_product(g4,p.m,m,4);
+        copy(m,m+16,p.m);
+      }
+      continue;
+    }
 
+    if (pending[s]>=0 || pending[t]>=0){
+      // the held back gates are applied first, and so are on the right
+      FusedGate pair;
+      pair.kind = FusedGate::PAIR;
+      pair.q0 = t;
+      pair.q1 = s;
+      pair_matrix(gate,pair,pair.m);
+      int qs[2] = {t,s};
+      for (int j=0; j<2; j++){
+        int q = qs[j];
+        if (pending[q]>=0){
+          complex<double> g4[16];
+          pair_matrix(fused[pending[q]],pair,g4);
+          matrix_product(pair.m,g4,m,4);
+          copy(m,m+16,pair.m);
+          // the held back gate is now done by the pair, so it becomes the identity, and is removed below
+          fused[pending[q]].kind = FusedGate::INIT;
+          fused[pending[q]].q0 = -1;
+          pending[q] = -1;
+        }
+      }
+      gate = pair;
     }
+    last[s] = last[t] = fused.size();
+    fused.push_back(gate);
+  }
 
-    return probs;
+  // remove the gates that were absorbed into pairs
+  int kept = 0;
+  for (int j=0; j<fused.size(); j++){
+    if (fused[j].kind!=FusedGate::INIT || fused[j].q0>=0){
+      fused[kept++] = fused[j];
+    }
   }
+  fused.resize(kept);
+}
+
+// The xoshiro256** generator of Blackman and Vigna: fast, with 64 bit outputs and a period of 2^256-1.
+// It can be used with the distributions of <random>. Independent streams, for example one per thread, are made
+// by copying a generator and calling jump() on the copy, which moves it ahead by 2^128 outputs.
+class Xoshiro256 {
 
   public:
 
-    QuantumCircuit qc;
-    int shots;
+    typedef unsigned long long result_type;
 
-    Simulator (QuantumCircuit qc_in, int shots_in = 1024) {
-      srand((unsigned)time(0));//seed for rand() calculated from the epoch date
-      qc = qc_in;
-      shots = shots_in;
+    Xoshiro256 (result_type seed = 0) {
+      set_seed(seed);
     }
 
-    vector<complex<double>> get_statevector () {
-    
-      vector<vector<double>> ket;
-      ket = simulate(qc);
-      vector<complex<double>> complex_ket;
-
-      for (int j=0; j<ket.size(); j++){
-        complex<double> e (ket[j][0],ket[j][1]);
-        complex_ket.push_back( e );
+    // The state is filled from the seed by splitmix64, so that similar seeds still give unrelated streams.
+    void set_seed (result_type seed) {
+      for (int j=0; j<4; j++){
+        seed += 0x9e3779b97f4a7c15ULL;
+        result_type z = seed;
+        z = (z^(z>>30))*0xbf58476d1ce4e5b9ULL;
+        z = (z^(z>>27))*0x94d049bb133111ebULL;
+        st[j] = z^(z>>31);
       }
+    }
 
-      return complex_ket;
+    static result_type min () { return 0; }
+    static result_type max () { return ~result_type(0); }
+
+    result_type operator() () {
+      result_type out = rotl(st[1]*5,7)*9;
+      result_type t = st[1]<<17;
+      st[2] ^= st[0];
+      st[3] ^= st[1];
+      st[1] ^= st[2];
+      st[0] ^= st[3];
+      st[2] ^= t;
+      st[3] = rotl(st[3],45);
+      return out;
     }
 
-    vector<string> get_memory () {
+    // A uniform random number in [0,1), with the full 53 bits of a double.
+    double uniform () {
+      return ((*this)()>>11)*(1.0/9007199254740992.0);
+    }
 
-      vector<double> probs;
-      probs = get_probs(qc);
+    // Moves ahead by 2^128 outputs.
+    void jump () {
+      static const result_type JUMP[4] = { 0x180ec6d33cfd0abaULL, 0xd5a61266f0c9392cULL, 0xa9582618e03fc9aaULL, 0x39abdc4529b1661cULL };
+      advance(JUMP);
+    }
 
-      vector<string> memory;
+    // Moves ahead by 2^192 outputs, giving room for 2^64 calls to jump() before streams overlap.
+    void long_jump () {
+      static const result_type LONG_JUMP[4] = { 0x76e15d3efefdcbbfULL, 0xc5004e441c522fb3ULL, 0x77710069854ee241ULL, 0x39109bb02acbe635ULL };
+      advance(LONG_JUMP);
+    }
 
-      for (int s=0; s<shots; s++){
+  private:
+
+    result_type st[4];
 
-        double cumu = 0;
-        bool un = true;
-        double r = double(rand())/RAND_MAX;
-        vector<char> bitstr (qc.nQubits,'0');
+    static result_type rotl (result_type x, int k) {
+      return (x<<k) | (x>>(64-k));
+    }
 
-        for (int j=0; j<probs.size();j++){
-          cumu += probs[j];//this will add up to 1  
-          if ((r<=cumu) && un){
-            for( int w=0; w<bitstr.size(); w++ ){
-              bool result = int(pow(2,w))&j;
-              bitstr[qc.nQubits-1-w]= result?'1':'0';
+    void advance (const result_type poly[4]) {
+      result_type s[4] = {0,0,0,0};
+      for (int j=0; j<4; j++){
+        for (int b=0; b<64; b++){
+          if (poly[j] & (result_type(1)<<b)){
+            for (int k=0; k<4; k++){
+              s[k] ^= st[k];
             }
-            string out(bitstr.begin(), bitstr.end());
-            memory.push_back( out );
-            un = false;
           }
+          (*this)();
         }
       }
+      for (int k=0; k<4; k++){
+        st[k] = s[k];
+      }
+    }
 
-      return memory;//e.g. <"10","10","10","10","10","10","10","10","10","10">
+};
+
+// A seed for a simulator that is not given one, which differs for every call. It mixes the hardware random source and
+// the time with a count of the calls, which is atomic since simulators may be made on several threads at once.
+inline unsigned long long default_seed () {
+  random_device device;
+  static atomic<unsigned long long> created (0);
+  return (((unsigned long long)device())<<32) ^ device() ^ (unsigned long long)time(0) ^ ((created.fetch_add(1)+1)<<48);
+}
+
+// Parallel chunks of pairs start on a multiple of this, which is a multiple of every SIMD step.
+// The pairs are then split between kernels exactly as in the serial case, so the results are bit-identical.
+const size_t PARALLEL_ALIGN = 8;
+
+// Sets k to the all |0> state of n qubits, reusing its memory if it is already the right size.
+template <typename R>
+inline void reset_ket (vector<complex<R>> &k, int n) {
+  k.assign(size_t(1)<<n, complex<R>(0.0,0.0));
+  k[0] = 1.0;
+}
+
+// Sets the count amplitudes at k to those from number offset onwards of a ket of the given size, as given by the
+// initialize op of an INIT gate. By default this is the whole ket.
+template <typename R>
+inline void apply_init (const QuantumCircuit &qc, const FusedGate &gate, complex<R> *k, size_t size, size_t offset, size_t count) {
+  const QuantumCircuit::Op &op = qc.data[gate.q0];
+  size_t initsize = op.control;
+  const double *p = &qc.op_data[op.target];
+  if(initsize==size){
+    //if just a simple list
+    for(size_t i=0; i<count; i++){
+      k[i] = complex<R>(p[offset+i],0.0);
+    }
+  } else {
+    //else it must be a complete list
+    for(size_t i=0; i<count; i++){
+      k[i] = complex<R>(p[2*(offset+i)],p[2*(offset+i)+1]);
     }
+  }
+}
 
-    map<string, int> get_counts () {
+template <typename R>
+inline void apply_init (const QuantumCircuit &qc, const FusedGate &gate, complex<R> *k, size_t size) {
+  apply_init(qc, gate, k, size, 0, size);
+}
 
-      map<string, int> counts;
-      vector<string> memory = get_memory();
-      if(memory.size()>0){
-        for (int s=0; s<shots; s++){
-          counts[memory[s]] += 1;//aggregate by key/bitstr
-        }
-      }
-      
-      return counts;
+// Applies a fused gate other than INIT to the size amplitudes at k, using the pool if there is one.
+template <typename R>
+inline void apply_fused (const FusedGate &gate, complex<R> *k, size_t size, WorkerPool *pool) {
+
+  // calls f(begin,end) for the given number of pairs or quads, split across the workers if there are any.
+  // the kernels below capture only k and the gate, so that each fits in a function without allocating
+  auto run = [pool](size_t count, size_t align, const function<void(size_t,size_t)> &f){
+    if (pool){
+      pool->run(count,align,f);
+    } else {
+      f(0,count);
     }
+  };
 
-    string get_qiskit () {
-      string qiskitPy;
+  if ( gate.kind==FusedGate::PAIR || gate.kind==FusedGate::SWAP ){
 
-      if (qc.nBits==0){
-        qiskitPy += "qc = QuantumCircuit("+to_string(qc.nQubits)+")\n";
+    // the quads are the elements whose bit strings differ only on bits q0 and q1
+    size_t quads = size/4;
+    if (gate.kind==FusedGate::SWAP){
+      run(quads, 1, [k,&gate](size_t begin, size_t end){ apply_swap(k,gate.q0,gate.q1,begin,end); });
+    } else {
+      run(quads, PARALLEL_ALIGN, [k,&gate](size_t begin, size_t end){ apply_matrix4(k,gate.q0,gate.q1,gate.m,begin,end); });
+    }
+
+  } else {
+
+    // a 2x2 matrix on the target, which for controlled gates acts only where the control is 1.
+    // the pairs are the elements whose bit strings differ only on bit q0 (and have a 1 on bit q1, if there is a control).
+    size_t pairs = size >> (gate.q1<0 ? 1 : 2);
+    if (gate.m[1]==0.0 && gate.m[2]==0.0){
+      run(pairs, PARALLEL_ALIGN, [k,&gate](size_t begin, size_t end){ apply_diagonal(k,gate.q0,gate.q1,gate.m[0],gate.m[3],begin,end); });
+    } else {
+      run(pairs, PARALLEL_ALIGN, [k,&gate](size_t begin, size_t end){ apply_matrix(k,gate.q0,gate.q1,gate.m,begin,end); });
+    }
+
+  }
+
+}
+
+// Applies the gates of qc from number first onwards to the given ket, using the pool if there is one.
+// The merged gates are put in fused, which is only passed in so that its memory can be reused from one call to the next.
+template <typename R>
+inline void run_gates (const QuantumCircuit &qc, vector<complex<R>> &ket, size_t first, bool fusion, WorkerPool *pool, vector<FusedGate> &fused) {
+
+  // the gates of qc.data are first merged where possible, and the resulting gates applied in order
+  fuse_gates(qc,fused,fusion,first);
+
+  for (int g=0; g<fused.size(); g++){
+    if ( fused[g].kind==FusedGate::INIT ){
+      apply_init(qc, fused[g], ket.data(), ket.size());
+    } else {
+      apply_fused(fused[g], ket.data(), ket.size(), pool);
+    }
+  }
+
+}
+
+template <typename R>
+inline void run_gates (const QuantumCircuit &qc, vector<complex<R>> &ket, size_t first, bool fusion, WorkerPool *pool) {
+  vector<FusedGate> fused;
+  run_gates(qc,ket,first,fusion,pool,fused);
+}
+
+// Keeps track of a ket whose qubits have been reordered, for moving the qubits of gates into the lowest (local) positions.
+// where[q] is the position in the ket of the bit for qubit q, and who[p] the qubit whose bit is at position p.
+struct QubitLayout {
+
+  vector<int> where, who;
+
+  void reset (int n) {
+    where.resize(n);
+    who.resize(n);
+    for (int q=0; q<n; q++){
+      where[q] = who[q] = q;
+    }
+  }
+
+  // Records that the bits at positions p0 and p1 have been swapped.
+  void swap_positions (int p0, int p1) {
+    swap(where[who[p0]],where[who[p1]]);
+    swap(who[p0],who[p1]);
+  }
+
+  bool is_local (const FusedGate &gate, int local) const {
+    return where[gate.q0]<local && (gate.q1<0 || where[gate.q1]<local);
+  }
+
+  // The gate as it applies to the reordered ket.
+  FusedGate place (const FusedGate &gate) const {
+    FusedGate placed = gate;
+    placed.q0 = where[gate.q0];
+    if (gate.q1>=0){
+      placed.q1 = where[gate.q1];
+    }
+    return placed;
+  }
+
+  // The local position to give up for the qubits of fused[g]: that of the qubit not needed for longest, other than those.
+  int evict (const vector<FusedGate> &fused, size_t g, int local) const {
+    int best = -1;
+    size_t best_next = 0;
+    for (int p=0; p<local; p++){
+      int q = who[p];
+      if (q==fused[g].q0 || q==fused[g].q1){
+        continue;
+      }
+      size_t next = g;
+      while (next<fused.size() && fused[next].kind!=FusedGate::INIT && fused[next].q0!=q && fused[next].q1!=q){
+        next++;
+      }
+      if (best<0 || next>best_next){
+        best = p;
+        best_next = next;
+      }
+    }
+    return best;
+  }
+
+};
+
+// Applies the fused gates to the ket of n qubits at k, as a series of chunks of 2^local amplitudes. Consecutive gates on
+// qubits below local are done together on each chunk before moving to the next, so that each chunk is loaded into fast
+// memory (cache, or RAM for a mapped file) once for the whole group, rather than once per gate. With a pool, the workers
+// share out the chunks if there are enough of them, and otherwise share out each gate as in run_gates.
+// A gate on a higher qubit is made local first, by swapping that qubit with the local one whose next use is furthest away.
+// The qubits are swapped back at the end, so the ket has the usual layout before and after.
+template <typename R>
+inline void run_blocked (const QuantumCircuit &qc, complex<R> *k, int n, const vector<FusedGate> &fused, int local, WorkerPool *pool) {
+
+  local = max(min(local,n),min(n,2));
+  size_t size = size_t(1)<<n;
+  size_t chunk = size_t(1)<<local;
+
+  QubitLayout layout;
+  layout.reset(n);
+  auto swap_positions = [&](int p0, int p1){
+    FusedGate exchange;
+    exchange.kind = FusedGate::SWAP;
+    exchange.q0 = p0;
+    exchange.q1 = p1;
+    apply_fused(exchange, k, size, pool);
+    layout.swap_positions(p0,p1);
+  };
+
+  vector<FusedGate> group;
+  size_t g = 0;
+  while (g<fused.size()){
+
+    if (fused[g].kind==FusedGate::INIT){
+      // the whole ket is overwritten, so the layout can simply be reset
+      layout.reset(n);
+      apply_init(qc, fused[g], k, size);
+      g++;
+      continue;
+    }
+
+    // bring the qubits of this gate into the chunk
+    int qubits[2] = {fused[g].q0, fused[g].q1};
+    for (int j=0; j<2; j++){
+      if (qubits[j]>=0 && layout.where[qubits[j]]>=local){
+        swap_positions(layout.evict(fused,g,local), layout.where[qubits[j]]);
+      }
+    }
+
+    // this gate and all that follow it on local qubits are done chunk by chunk
+    group.clear();
+    while (g<fused.size() && fused[g].kind!=FusedGate::INIT && layout.is_local(fused[g],local)){
+      group.push_back(layout.place(fused[g]));
+      g++;
+    }
+    if (pool && (size>>local)>=pool->size()){
+      // the chunks are independent, so each worker takes whole chunks
+      pool->run(size>>local, 1, [&](size_t begin, size_t end){
+        for (size_t c=begin; c<end; c++){
+          for (size_t j=0; j<group.size(); j++){
+            apply_fused(group[j], k+(c<<local), chunk, (WorkerPool*)NULL);
+          }
+        }
+      });
+    } else {
+      for (size_t c=0; c<size; c+=chunk){
+        for (size_t j=0; j<group.size(); j++){
+          apply_fused(group[j], k+c, chunk, pool);
+        }
+      }
+    }
+
+  }
+
+  for (int q=0; q<n; q++){
+    if (layout.where[q]!=q){
+      swap_positions(q, layout.where[q]);
+    }
+  }
+
+}
+
+// Walker's alias table, for drawing samples from a discrete probability distribution in constant time.
+// Building it takes time linear in the number of outcomes. Each outcome j is given a column, which holds j with
+// probability prob[j] and the outcome alias[j] otherwise, such that every column is chosen with equal probability.
+class AliasTable {
+
+  public:
+
+    vector<double> prob;
+    vector<size_t> alias;
+    vector<size_t> small, large; // only used while building, but kept so that rebuilding reuses their memory
+
+    AliasTable () {
+
+    }
+    template <typename P>
+    AliasTable (const vector<P> &p) {
+      build(p);
+    }
+
+    // The probabilities need not be normalized, and may be float or double.
+    template <typename P>
+    void build (const vector<P> &p) {
+      size_t n = p.size();
+      prob.resize(n);
+      alias.resize(n);
+      double total = 0;
+      for (size_t j=0; j<n; j++){
+        total += p[j];
+      }
+      // outcomes are sorted into those with less and more than the average, and each small one is topped up by a large one
+      small.clear();
+      large.clear();
+      for (size_t j=0; j<n; j++){
+        prob[j] = double(p[j])*n/total;
+        alias[j] = j;
+        if (prob[j]<1.0){
+          small.push_back(j);
+        } else {
+          large.push_back(j);
+        }
+      }
+      while (!small.empty() && !large.empty()){
+        size_t s = small.back();
+        size_t l = large.back();
+        small.pop_back();
+        alias[s] = l;
+        prob[l] -= 1.0-prob[s];
+        if (prob[l]<1.0){
+          large.pop_back();
+          small.push_back(l);
+        }
+      }
+      // anything left is only off from 1 due to rounding
+      for (size_t j=0; j<small.size(); j++){
+        prob[small[j]] = 1.0;
+      }
+      for (size_t j=0; j<large.size(); j++){
+        prob[large[j]] = 1.0;
+      }
+    }
+
+    // Gives the outcome for a uniform random number r in [0,1). The integer part of r*n picks the column, and the fraction decides within it.
+    size_t sample (double r) const {
+      double x = r*prob.size();
+      size_t j = min(size_t(x),prob.size()-1);
+      return (x-j<prob[j]) ? j : alias[j];
+    }
+
+};
+
+// Draws the counts for the given number of shots from the probabilities, as (outcome, count) pairs in order of outcome.
+// Rather than sampling each shot, the counts are drawn as one multinomial sample: going through the outcomes in turn,
+// the count of each is binomial, given the shots and probability not yet used up by the previous ones.
+// This takes one pass over the probabilities, and memory only for the outcomes that occur.
+// Here the probability of each outcome j from 0 to outcomes-1 is given by prob(j), so that they need not be stored.
+template <typename F>
+inline void sample_counts_of (size_t outcomes, const F &prob, int shots, Xoshiro256 &rng, vector<pair<size_t, int>> &counts) {
+  counts.clear();
+  int remaining = shots;
+  double left = 0;
+  for (size_t j=0; j<outcomes; j++){
+    left += prob(j);
+  }
+  for (size_t j=0; j<outcomes && remaining>0; j++){
+    double p = prob(j);
+    if (p<=0){
+      continue;
+    }
+    int k = remaining;
+    if (p<left){
+      binomial_distribution<int> binomial (remaining, p/left);
+      k = binomial(rng);
+    }
+    if (k>0){
+      counts.push_back( make_pair(j,k) );
+      remaining -= k;
+    }
+    left -= p;
+  }
+}
+
+template <typename P>
+inline void sample_counts (const vector<P> &probs, int shots, Xoshiro256 &rng, vector<pair<size_t, int>> &counts) {
+  sample_counts_of(probs.size(), [&probs](size_t j){ return double(probs[j]); }, shots, rng, counts);
+}
+
+// Sets out to the n bit string for the outcome j, with bit 0 on the right.
+inline void bitstring (size_t j, int n, string &out) {
+  out.assign(n,'0');
+  for( int w=0; w<n; w++ ){
+    if ((j>>w)&1){
+      out[n-1-w] = '1';
+    }
+  }
+}
+
+// Turns counts keyed by outcome into counts keyed by the n bit string of each outcome, as get_counts gives them.
+inline map<string, int> counts_to_strings (const map<size_t, int> &int_counts, int n) {
+  map<string, int> counts;
+  string out;
+  for (map<size_t, int>::const_iterator iter = int_counts.begin(); iter != int_counts.end(); ++iter){
+    bitstring(iter->first, n, out);
+    counts[out] = iter->second;
+  }
+  return counts;
+}
+
+// A store of spare ket and probability buffers, shared by the Simulators given it with set_buffers.
+// Each takes its buffers from the pool when it first needs them and gives them back when it is destroyed, so a process
+// that makes a new Simulator for every run settles on the same few buffers rather than allocating new ones each time.
+// Spare buffers are only kept up to max_bytes in total, which bounds the memory held between runs.
+// It can be shared between threads.
+class BufferPool {
+
+  public:
+
+    BufferPool (size_t max_bytes_in = size_t(-1)) {
+      max_bytes = max_bytes_in;
+      held = 0;
+    }
+
+    // Gives v room for n elements, from a spare buffer if there is one big enough. v keeps its contents if it already has room.
+    void take (vector<complex<double>> &v, size_t n) {
+      take(kets,v,n);
+    }
+    void take (vector<double> &v, size_t n) {
+      take(reals,v,n);
+    }
+    void take (vector<complex<float>> &v, size_t n) {
+      take(float_kets,v,n);
+    }
+    void take (vector<float> &v, size_t n) {
+      take(floats,v,n);
+    }
+
+    // Keeps the memory of v as a spare buffer, if there is space for it, and leaves v empty.
+    void give (vector<complex<double>> &v) {
+      give(kets,v);
+    }
+    void give (vector<double> &v) {
+      give(reals,v);
+    }
+    void give (vector<complex<float>> &v) {
+      give(float_kets,v);
+    }
+    void give (vector<float> &v) {
+      give(floats,v);
+    }
+
+    // The bytes held in spare buffers.
+    size_t bytes () {
+      lock_guard<mutex> lock (m);
+      return held;
+    }
+
+  private:
+
+    mutex m;
+    size_t max_bytes, held;
+    vector<vector<complex<double>>> kets;
+    vector<vector<double>> reals;
+    vector<vector<complex<float>>> float_kets;
+    vector<vector<float>> floats;
+
+    template <typename T>
+    void take (vector<vector<T>> &spare, vector<T> &v, size_t n) {
+      if (v.capacity()>=n){
+        return;
+      }
+      lock_guard<mutex> lock (m);
+      // the smallest spare that is big enough, so that large ones are left for large circuits
+      size_t best = spare.size();
+      for (size_t j=0; j<spare.size(); j++){
+        if (spare[j].capacity()>=n && (best==spare.size() || spare[j].capacity()<spare[best].capacity())){
+          best = j;
+        }
+      }
+      if (best<spare.size()){
+        held -= spare[best].capacity()*sizeof(T);
+        // v's old memory, if any, is smaller than needed and is dropped rather than kept
+        v.swap(spare[best]);
+        spare.erase(spare.begin()+best);
+      }
+    }
+
+    template <typename T>
+    void give (vector<vector<T>> &spare, vector<T> &v) {
+      size_t bytes = v.capacity()*sizeof(T);
+      if (bytes>0){
+        lock_guard<mutex> lock (m);
+        if (held+bytes<=max_bytes){
+          held += bytes;
+          spare.push_back(vector<T>());
+          spare.back().swap(v);
+          spare.back().clear();
+        }
+      }
+      vector<T>().swap(v);
+    }
+
+};
+
+// Adds the columns j0 to j1 of the dim x dim column major matrix u, weighted by the amplitudes j0 to j1 of each of the given
+// number of kets at in, to the outputs for those kets at out. Each step covers a strip of the rows for two kets at a time.
+// The sums over the columns are kept as {re,im}*xr and {re,im}*xi, and only combined into complex products once per strip.
+inline void multiply_columns_scalar (const complex<double> *u, size_t dim, const complex<double> *in, complex<double> *out, size_t kets, size_t j0, size_t j1) {
+  const double *c = reinterpret_cast<const double*>(u);
+  for (size_t k=0; k<kets; k++){
+    const double *x = reinterpret_cast<const double*>(in+k*dim);
+    double *y = reinterpret_cast<double*>(out+k*dim);
+    for (size_t j=j0; j<j1; j++){
+      double xr = x[2*j], xi = x[2*j+1];
+      const double *col = c + 2*j*dim;
+      for (size_t i=0; i<dim; i++){
+        y[2*i] += col[2*i]*xr - col[2*i+1]*xi;
+        y[2*i+1] += col[2*i+1]*xr + col[2*i]*xi;
+      }
+    }
+  }
+}
+
+#ifdef MICROQISKIT_SIMD
+
+// strips of 4 rows, so dim must be a multiple of 4
+__attribute__((target("avx2,fma")))
+inline void multiply_columns_avx2 (const complex<double> *u, size_t dim, const complex<double> *in, complex<double> *out, size_t kets, size_t j0, size_t j1) {
+  const double *c = reinterpret_cast<const double*>(u);
+  for (size_t i=0; i<dim; i+=4){
+    for (size_t k=0; k<kets; k+=2){
+      // for an odd number of kets, the last is done twice over and stored once
+      const double *a = reinterpret_cast<const double*>(in+k*dim);
+      const double *b = (k+1<kets) ? a+2*dim : a;
+      __m256d pa0 = _mm256_setzero_pd(), pa1 = pa0, qa0 = pa0, qa1 = pa0;
+      __m256d pb0 = pa0, pb1 = pa0, qb0 = pa0, qb1 = pa0;
+      for (size_t j=j0; j<j1; j++){
+        const double *col = c + 2*(j*dim+i);
+        __m256d c0 = _mm256_loadu_pd(col), c1 = _mm256_loadu_pd(col+4);
+        __m256d ar = _mm256_broadcast_sd(a+2*j), ai = _mm256_broadcast_sd(a+2*j+1);
+        __m256d br = _mm256_broadcast_sd(b+2*j), bi = _mm256_broadcast_sd(b+2*j+1);
+        pa0 = _mm256_fmadd_pd(c0, ar, pa0);
+        pa1 = _mm256_fmadd_pd(c1, ar, pa1);
+        qa0 = _mm256_fmadd_pd(c0, ai, qa0);
+        qa1 = _mm256_fmadd_pd(c1, ai, qa1);
+        pb0 = _mm256_fmadd_pd(c0, br, pb0);
+        pb1 = _mm256_fmadd_pd(c1, br, pb1);
+        qb0 = _mm256_fmadd_pd(c0, bi, qb0);
+        qb1 = _mm256_fmadd_pd(c1, bi, qb1);
+      }
+      // {pr - qi, pi + qr} is the complex product
+      double *y = reinterpret_cast<double*>(out+k*dim+i);
+      _mm256_storeu_pd(y, _mm256_add_pd(_mm256_loadu_pd(y), _mm256_addsub_pd(pa0, _mm256_permute_pd(qa0,5))));
+      _mm256_storeu_pd(y+4, _mm256_add_pd(_mm256_loadu_pd(y+4), _mm256_addsub_pd(pa1, _mm256_permute_pd(qa1,5))));
+      if (k+1<kets){
+        y += 2*dim;
+        _mm256_storeu_pd(y, _mm256_add_pd(_mm256_loadu_pd(y), _mm256_addsub_pd(pb0, _mm256_permute_pd(qb0,5))));
+        _mm256_storeu_pd(y+4, _mm256_add_pd(_mm256_loadu_pd(y+4), _mm256_addsub_pd(pb1, _mm256_permute_pd(qb1,5))));
+      }
+    }
+  }
+}
+
+// strips of 16 rows, so dim must be a multiple of 16
+__attribute__((target("avx512f")))
+inline void multiply_columns_avx512 (const complex<double> *u, size_t dim, const complex<double> *in, complex<double> *out, size_t kets, size_t j0, size_t j1) {
+  const double *c = reinterpret_cast<const double*>(u);
+  __m512d one = _mm512_set1_pd(1.0);
+  for (size_t i=0; i<dim; i+=16){
+    for (size_t k=0; k<kets; k+=2){
+      const double *a = reinterpret_cast<const double*>(in+k*dim);
+      const double *b = (k+1<kets) ? a+2*dim : a;
+      __m512d p[2][4], q[2][4];
+      for (int r=0; r<4; r++){
+        p[0][r] = p[1][r] = q[0][r] = q[1][r] = _mm512_setzero_pd();
+      }
+      for (size_t j=j0; j<j1; j++){
+        const double *col = c + 2*(j*dim+i);
+        __m512d ar = _mm512_set1_pd(a[2*j]), ai = _mm512_set1_pd(a[2*j+1]);
+        __m512d br = _mm512_set1_pd(b[2*j]), bi = _mm512_set1_pd(b[2*j+1]);
+        for (int r=0; r<4; r++){
+          __m512d cr = _mm512_loadu_pd(col+8*r);
+          p[0][r] = _mm512_fmadd_pd(cr, ar, p[0][r]);
+          q[0][r] = _mm512_fmadd_pd(cr, ai, q[0][r]);
+          p[1][r] = _mm512_fmadd_pd(cr, br, p[1][r]);
+          q[1][r] = _mm512_fmadd_pd(cr, bi, q[1][r]);
+        }
+      }
+      for (int h=0; h<2 && k+h<kets; h++){
+        double *y = reinterpret_cast<double*>(out+(k+h)*dim+i);
+        for (int r=0; r<4; r++){
+          // p*1 -/+ swapped q, which is the addsub above, with the swap masked as in apply_matrix_avx512
+          __m512d v = _mm512_fmaddsub_pd(p[h][r], one, _mm512_maskz_permute_pd(0xFF,q[h][r],0x55));
+          _mm512_storeu_pd(y+8*r, _mm512_add_pd(_mm512_loadu_pd(y+8*r), v));
+        }
+      }
+    }
+  }
+}
+
+#endif
+
+// Adds the product of the given columns of u with the kets to the outputs, using the fastest kernel available for this size.
+inline void multiply_columns (const complex<double> *u, size_t dim, const complex<double> *in, complex<double> *out, size_t kets, size_t j0, size_t j1) {
+#ifdef MICROQISKIT_SIMD
+  SimdLevel level = simd_level();
+  if (level==SIMD_AVX512 && dim>=16){
+    multiply_columns_avx512(u,dim,in,out,kets,j0,j1);
+    return;
+  } else if (level>=SIMD_AVX2 && dim>=4){
+    multiply_columns_avx2(u,dim,in,out,kets,j0,j1);
+    return;
+  }
+#endif
+  multiply_columns_scalar(u,dim,in,out,kets,j0,j1);
+}
+
+// The matrix of the gates of a circuit, for applying the same circuit to many input kets with one matrix multiply each
+// rather than a sweep of the ket per gate. Measure gates are left out, and initialize is not allowed, since it is not unitary.
+// The matrix is column major, so that column j (at m[j*dim] onwards) is the ket that the circuit gives for the input j.
+class Unitary {
+
+  public:
+
+    int nQubits;
+    size_t dim;
+    vector<complex<double>> m;
+
+    Unitary () {
+      nQubits = 0;
+      dim = 1;
+      m.assign(1, 1.0);
+    }
+
+    // Builds the matrix for qc by running the usual gate kernels on all of its columns at once, using the pool if there is one.
+    // The columns start as the basis states, and lie one after another as a ket of 2n qubits. A gate on qubit q of the
+    // circuit is then the same gate on bit q of this larger ket, so each sweep of it applies the gate to every column.
+    Unitary (const QuantumCircuit &qc, bool fusion = true, WorkerPool *pool = NULL) {
+      nQubits = qc.nQubits;
+      if (2*nQubits>=64){
+        ERROR("Unitary: The circuit has too many qubits for its matrix to be stored");
+      }
+      dim = size_t(1)<<nQubits;
+      m.assign(dim*dim, 0.0);
+      for (size_t j=0; j<dim; j++){
+        m[j*dim+j] = 1.0;
+      }
+      verify_static(qc, "Unitary");
+      vector<FusedGate> fused;
+      fuse_gates(qc, fused, fusion);
+      for (size_t g=0; g<fused.size(); g++){
+        if (fused[g].kind==FusedGate::INIT){
+          ERROR("Unitary: Circuits with initialize have no unitary");
+        }
+        apply_fused(fused[g], m.data(), m.size(), pool);
+      }
+    }
+
+    vector<complex<double>> apply (const vector<complex<double>> &ket) const {
+      vector<vector<complex<double>>> outputs;
+      apply(vector<vector<complex<double>>>(1,ket), outputs);
+      return outputs[0];
+    }
+
+    // Multiplies each of the inputs by the matrix. The outputs are resized as needed, so their memory is reused between calls.
+    void apply (const vector<vector<complex<double>>> &inputs, vector<vector<complex<double>>> &outputs, WorkerPool *pool = NULL) const {
+      // gathered into one block, so that the multiply can run over them together
+      vector<complex<double>> in (inputs.size()*dim), out (inputs.size()*dim);
+      for (size_t k=0; k<inputs.size(); k++){
+        if (inputs[k].size()!=dim){
+          ERROR("Unitary: The inputs should have 2^n amplitudes");
+        }
+        copy(inputs[k].begin(), inputs[k].end(), in.begin()+k*dim);
+      }
+      apply(in.data(), out.data(), inputs.size(), pool);
+      outputs.resize(inputs.size());
+      for (size_t k=0; k<inputs.size(); k++){
+        outputs[k].assign(out.begin()+k*dim, out.begin()+(k+1)*dim);
+      }
+    }
+
+    // As above, for count kets stored one after another at in, with the results put in the same way at out.
+    // The kets are split between the workers of the pool, if there is one.
+    void apply (const complex<double> *in, complex<double> *out, size_t count, WorkerPool *pool = NULL) const {
+      if (pool){
+        pool->run(count, KET_BLOCK, [&](size_t begin, size_t end){ multiply(in, out, begin, end); });
+      } else {
+        multiply(in, out, 0, count);
+      }
+    }
+
+  private:
+
+    // the kets are taken in blocks, and within them the columns, so that the parts of the kets in use (64 kB) and the
+    // strips of the columns being read (16 kB or less, for any number of qubits) stay in cache
+    static const size_t KET_BLOCK = 32, COLUMN_BLOCK = 128;
+
+    // Works out the outputs for the kets from begin to end.
+    void multiply (const complex<double> *in, complex<double> *out, size_t begin, size_t end) const {
+      fill(out+begin*dim, out+end*dim, 0.0);
+      for (size_t k0=begin; k0<end; k0+=KET_BLOCK){
+        size_t kets = min(end-k0, size_t(KET_BLOCK));
+        for (size_t j0=0; j0<dim; j0+=COLUMN_BLOCK){
+          multiply_columns(m.data(), dim, in+k0*dim, out+k0*dim, kets, j0, min(dim, j0+COLUMN_BLOCK));
+        }
+      }
+    }
+
+};
+
+// Sets {a[j],b[j]} to {m00 a[j] + m01 b[j], m10 a[j] + m11 b[j]} for the count elements of each stripe, as for a 2x2
+// matrix of real numbers {m00,m01,m10,m11} on pairs of probabilities.
+template <typename P>
+inline void mix_stripes_scalar (P *a, P *b, size_t count, const array<double, 4> &m) {
+  P m00 = m[0], m01 = m[1], m10 = m[2], m11 = m[3];
+  for (size_t j=0; j<count; j++){
+    P x = a[j], y = b[j];
+    a[j] = m00*x + m01*y;
+    b[j] = m10*x + m11*y;
+  }
+}
+
+#ifdef MICROQISKIT_SIMD
+
+// these return the number of elements done, leaving the rest for the scalar kernel
+
+__attribute__((target("avx2,fma")))
+inline size_t mix_stripes_avx2 (double *a, double *b, size_t count, const array<double, 4> &m) {
+  __m256d m00 = _mm256_set1_pd(m[0]), m01 = _mm256_set1_pd(m[1]), m10 = _mm256_set1_pd(m[2]), m11 = _mm256_set1_pd(m[3]);
+  size_t j = 0;
+  for (; j+4<=count; j+=4){
+    __m256d x = _mm256_loadu_pd(a+j), y = _mm256_loadu_pd(b+j);
+    _mm256_storeu_pd(a+j, _mm256_fmadd_pd(m00, x, _mm256_mul_pd(m01, y)));
+    _mm256_storeu_pd(b+j, _mm256_fmadd_pd(m10, x, _mm256_mul_pd(m11, y)));
+  }
+  return j;
+}
+
+__attribute__((target("avx2,fma")))
+inline size_t mix_stripes_avx2 (float *a, float *b, size_t count, const array<double, 4> &m) {
+  __m256 m00 = _mm256_set1_ps(m[0]), m01 = _mm256_set1_ps(m[1]), m10 = _mm256_set1_ps(m[2]), m11 = _mm256_set1_ps(m[3]);
+  size_t j = 0;
+  for (; j+8<=count; j+=8){
+    __m256 x = _mm256_loadu_ps(a+j), y = _mm256_loadu_ps(b+j);
+    _mm256_storeu_ps(a+j, _mm256_fmadd_ps(m00, x, _mm256_mul_ps(m01, y)));
+    _mm256_storeu_ps(b+j, _mm256_fmadd_ps(m10, x, _mm256_mul_ps(m11, y)));
+  }
+  return j;
+}
+
+#endif
+
+// As mix_stripes_scalar, using AVX2 where available. These passes are bound by memory rather than arithmetic, so wider
+// registers would gain little.
+template <typename P>
+inline void mix_stripes (P *a, P *b, size_t count, const array<double, 4> &m) {
+  size_t done = 0;
+#ifdef MICROQISKIT_SIMD
+  if (simd_level()>=SIMD_AVX2){
+    done = mix_stripes_avx2(a, b, count, m);
+  }
+#endif
+  mix_stripes_scalar(a+done, b+done, count-done, m);
+}
+
+// Errors in reading out the qubits, independent for each qubit, as given by the noise_model of the Python version.
+// Qubit q is read as 1 when it is 0 with probability p01[q], and as 0 when it is 1 with probability p10[q].
+// apply() takes exact outcome probabilities to those of the readout, as a tensor product of the 2x2 confusion matrices,
+// and mitigate() undoes this with their inverses. Mitigated values are quasi-probabilities, which can be slightly negative.
+class ReadoutError {
+
+  public:
+
+    ReadoutError () {
+    }
+
+    // Each qubit is misread with probability flip[q], whatever its value.
+    ReadoutError (const vector<double> &flip) {
+      set(flip, flip);
+    }
+
+    ReadoutError (const vector<double> &p01, const vector<double> &p10) {
+      set(p01, p10);
+    }
+
+    bool empty () const {
+      return forward.empty();
+    }
+
+    int num_qubits () const {
+      return forward.size();
+    }
+
+    // Applies the errors to the 2^n probabilities in place, splitting each pass between the workers of the pool if there is one.
+    template <typename P>
+    void apply (vector<P> &probs, WorkerPool *pool = NULL) const {
+      transform(probs, forward, pool);
+    }
+
+    // Undoes apply(), for probabilities estimated from counts.
+    template <typename P>
+    void mitigate (vector<P> &probs, WorkerPool *pool = NULL) const {
+      transform(probs, inverse, pool);
+    }
+
+    // Mitigates counts given as (outcome, count) pairs, as from Simulator::get_int_counts, without making them dense.
+    // The results are the exact values of the inverse applied to the frequencies, for the outcomes that were seen, except
+    // that terms between outcomes that differ on more than max_distance bits are left out. These shrink by a factor of
+    // about p/(1-2p) per bit. Values for outcomes that were not seen are also left out, since they are small when the counts are.
+    // For each outcome, either all others are compared with it, or those within max_distance bits are looked up, whichever is quicker.
+    void mitigate (const vector<pair<size_t, int>> &counts, vector<pair<size_t, double>> &quasi, int max_distance = 3, WorkerPool *pool = NULL) const {
+      int n = num_qubits();
+      max_distance = min(max_distance, n);
+      double total = 0;
+      for (size_t j=0; j<counts.size(); j++){
+        total += counts[j].second;
+      }
+      // the term for counts of j in the value for s is the product over the qubits of inverse[q][s_q][j_q], which is
+      // the product of the diagonal entries for s, with each differing bit q changing its factor by ratio[q][s_q]
+      vector<double> ratio (2*n);
+      for (int q=0; q<n; q++){
+        ratio[2*q] = inverse[q][1]/inverse[q][0];
+        ratio[2*q+1] = inverse[q][2]/inverse[q][3];
+      }
+      double nearby = 1, choices = 1;
+      for (int d=1; d<=max_distance; d++){
+        choices = choices*(n-d+1)/d;
+        nearby += choices;
+      }
+      vector<pair<size_t, int>> sorted;
+      // a lookup is a binary search, which costs about as much as comparing with log2 of the outcomes
+      bool lookup = (nearby*(1+log2(double(counts.size())))<counts.size());
+      if (lookup){
+        sorted = counts;
+        sort(sorted.begin(), sorted.end());
+      }
+      quasi.resize(counts.size());
+      auto work = [&](size_t begin, size_t end){
+        for (size_t i=begin; i<end; i++){
+          size_t s = counts[i].first;
+          double diagonal = 1;
+          for (int q=0; q<n; q++){
+            diagonal *= ((s>>q)&1) ? inverse[q][3] : inverse[q][0];
+          }
+          double sum = 0;
+          if (lookup){
+            sum = nearby_sum(sorted, ratio, s, 0, 0, max_distance, 1.0);
+          } else {
+            for (size_t j=0; j<counts.size(); j++){
+              size_t d = s^counts[j].first;
+              if (count_ones(d)>max_distance){
+                continue;
+              }
+              double f = counts[j].second;
+              for (; d; d&=d-1){
+                int q = lowest_one(d);
+                f *= ratio[2*q+((s>>q)&1)];
+              }
+              sum += f;
+            }
+          }
+          quasi[i] = make_pair(s, diagonal*sum/total);
+        }
+      };
+      if (pool){
+        pool->run(counts.size(), 1, work);
+      } else {
+        work(0, counts.size());
+      }
+    }
+
+    map<size_t, double> mitigate (const map<size_t, int> &counts, int max_distance = 3) const {
+      vector<pair<size_t, double>> quasi;
+      mitigate(vector<pair<size_t, int>>(counts.begin(), counts.end()), quasi, max_distance);
+      return map<size_t, double>(quasi.begin(), quasi.end());
+    }
+
+  private:
+
+    // the 2x2 matrices {m00,m01,m10,m11} for each qubit, which take the probabilities {p0,p1} to {m00 p0 + m01 p1, m10 p0 + m11 p1}
+    vector<array<double, 4>> forward, inverse;
+
+    // the low qubits are done a tile of 2^14 probabilities at a time, so that each tile is read from memory once for all of them
+    static const int TILE_QUBITS = 14;
+
+    void set (const vector<double> &p01, const vector<double> &p10) {
+      if (p01.size()!=p10.size()){
+        ERROR("ReadoutError: There should be the same number of probabilities for each kind of error");
+      }
+      forward.resize(p01.size());
+      inverse.resize(p01.size());
+      for (size_t q=0; q<p01.size(); q++){
+        double det = 1 - p01[q] - p10[q];
+        if (p01[q]<0 || p10[q]<0 || det<=0){
+          ERROR("ReadoutError: The error probabilities for each qubit should be at least 0, with a sum below 1");
+        }
+        forward[q] = {1-p01[q], p10[q], p01[q], 1-p10[q]};
+        inverse[q] = {(1-p10[q])/det, -p10[q]/det, -p01[q]/det, (1-p01[q])/det};
+      }
+    }
+
+    // Sums the counts for the outcomes s^flipped, for all flipped that add at most left more bits to the given one above bit
+    // from. Each is weighted by f times the ratios for the bits it adds.
+    double nearby_sum (const vector<pair<size_t, int>> &sorted, const vector<double> &ratio, size_t s, size_t flipped, int from, int left, double f) const {
+      double sum = 0;
+      size_t j = s^flipped;
+      vector<pair<size_t, int>>::const_iterator found = lower_bound(sorted.begin(), sorted.end(), j, [](const pair<size_t, int> &a, size_t key){ return a.first<key; });
+      if (found!=sorted.end() && found->first==j){
+        sum += f*found->second;
+      }
+      if (left>0){
+        for (int q=from; q<num_qubits(); q++){
+          sum += nearby_sum(sorted, ratio, s, flipped|(size_t(1)<<q), q+1, left-1, f*ratio[2*q+((s>>q)&1)]);
+        }
+      }
+      return sum;
+    }
+
+    template <typename P>
+    void transform (vector<P> &probs, const vector<array<double, 4>> &m, WorkerPool *pool) const {
+      int n = num_qubits();
+      if (probs.size()!=(size_t(1)<<n)){
+        ERROR("ReadoutError: There should be 2^n probabilities for n qubits");
+      }
+      P *p = probs.data();
+      int low = min(n, int(TILE_QUBITS));
+      size_t tile = size_t(1)<<low;
+      auto tiles = [&](size_t begin, size_t end){
+        for (size_t t=begin; t<end; t++){
+          for (int q=0; q<low; q++){
+            mix(p+(t<<low), q, m[q], 0, tile/2);
+          }
+        }
+      };
+      if (pool){
+        pool->run(probs.size()>>low, 1, tiles);
+      } else {
+        tiles(0, probs.size()>>low);
+      }
+      for (int q=low; q<n; q++){
+        if (pool){
+          pool->run(probs.size()/2, tile, [&](size_t begin, size_t end){ mix(p, q, m[q], begin, end); });
+        } else {
+          mix(p, q, m[q], 0, probs.size()/2);
+        }
+      }
+    }
+
+    // Applies the 2x2 matrix to the pairs of probabilities for qubit q numbered from begin to end. Pairs come in runs of
+    // 2^q for which both halves are contiguous, and so each run is done by mix_stripes.
+    template <typename P>
+    static void mix (P *p, int q, const array<double, 4> &m, size_t begin, size_t end) {
+      P m00 = m[0], m01 = m[1], m10 = m[2], m11 = m[3];
+      if (q==0){
+        for (size_t i=begin; i<end; i++){
+          P x = p[2*i], y = p[2*i+1];
+          p[2*i] = m00*x + m01*y;
+          p[2*i+1] = m10*x + m11*y;
+        }
+        return;
+      }
+      size_t bit = size_t(1)<<q;
+      size_t i = begin;
+      while (i<end){
+        size_t run = min(end-i, bit-(i&(bit-1)));
+        P *a = p + insert_zero_bit(i,q);
+        mix_stripes(a, a+bit, run, m);
+        i += run;
+      }
+    }
+
+};
+
+// The amplitudes are complex<R>, and the probabilities worked out from them are P. See the typedefs below for the choices.
+template <typename R, typename P = R>
+class BasicSimulator {
+  // Contains methods required to simulate a circuit and provide the desired outputs.
+
+  shared_ptr<WorkerPool> workers;
+  int threads, parallel_qubits;
+  int tile_qubits, blocked_qubits;
+  bool fusion;
+  Xoshiro256 rng;
+
+  // shots are sampled in blocks of this many, each with its own stream of random numbers.
+  // the results then depend only on the seed, and not on how the blocks are split between threads.
+  static const int SHOT_BLOCK = 1<<16;
+
+  // Gives the workers, started if needed, or NULL if only one thread is to be used.
+  WorkerPool *get_pool () {
+    if (threads<=1){
+      return NULL;
+    }
+    if (!workers || workers->size()!=threads){
+      workers = make_shared<WorkerPool>(threads);
+    }
+    return workers.get();
+  }
+
+  // the results for qc are kept from one query to the next, and only recomputed when needed.
+  // the ket holds the state after the first simulated_gates gates of simulated, a copy of qc as it was last simulated.
+  // gates appended since are applied to it directly. if any earlier gate has been removed or changed, it is restored from
+  // the latest snapshot before the first difference.
+  vector<complex<R>> ket;
+  vector<P> probs;
+  AliasTable table;
+  bool have_ket, have_probs, have_table;
+  size_t simulated_gates;
+  int simulated_qubits;
+  QuantumCircuit simulated;
+  map<size_t, vector<complex<R>>> snapshots; // keyed by the number of gates applied, which are all the same as in simulated
+
+  // where the ket and probs get their memory from, if anywhere. the other vectors are scratch space kept between runs
+  shared_ptr<BufferPool> buffers;
+  vector<FusedGate> fused;
+  vector<pair<size_t, int>> sampled;
+  ReadoutError readout;
+
+  // Makes sure the ket is up to date with the circuit.
+  void update () {
+    if (have_ket && qc.nQubits!=simulated_qubits){
+      // a different register, so nothing can be reused
+      invalidate();
+      snapshots.clear();
+    }
+    if (have_ket){
+      // gates may have been removed, and others added in their place, so the circuit is compared with the one simulated.
+      // this is one pass over the gates, which costs little next to a pass over the ket
+      size_t same = 0, common = min(qc.data.size(), simulated_gates);
+      while (same<common && qc.same_gate(same, simulated, same)){
+        same++;
+      }
+      if (same<simulated_gates){
+        // snapshots from after the first difference are no longer valid
+        snapshots.erase(snapshots.upper_bound(same), snapshots.end());
+        if (snapshots.empty()){
+          invalidate();
+        } else {
+          ket = snapshots.rbegin()->second;
+          simulated_gates = snapshots.rbegin()->first;
+          have_probs = have_table = false;
+        }
+      }
+    }
+    if (!have_ket){
+      // the ket is a single contiguous buffer of complex amplitudes, updated in place by every gate.
+      // all amplitudes start at zero, except the first. this means that by default it will be measuring 0, because that's the first bitstr.
+      // e.g. for 2 qubits < (1,0) (0,0) (0,0) (0,0) >
+      if (buffers){
+        buffers->take(ket, size_t(1)<<qc.nQubits);
+      }
+      reset_ket(ket, qc.nQubits);
+      have_ket = true;
+      simulated_gates = 0;
+      simulated_qubits = qc.nQubits;
+    }
+    if (qc.data.size()>simulated_gates){
+      simulate(simulated_gates);
+      simulated_gates = qc.data.size();
+      have_probs = have_table = false;
+      simulated = qc;
+    }
+  }
+
+  // Applies the gates of qc from number first onwards to the ket.
+  void simulate (size_t first) {
+    // small registers are done serially, since waking the workers for each gate would cost more than it saves
+    WorkerPool *pool = (qc.nQubits>=parallel_qubits) ? get_pool() : NULL;
+    if (tile_qubits>0 && qc.nQubits>=blocked_qubits && qc.nQubits>tile_qubits){
+      fuse_gates(qc, fused, fusion, first);
+      run_blocked(qc, ket.data(), qc.nQubits, fused, tile_qubits, pool);
+    } else {
+      run_gates(qc, ket, first, fusion, pool, fused);
+    }
+  }
+
+  const vector<P> &get_probs () {
+
+    if(!qc.has_measurements()){
+      ERROR("get_probs: The circuit should have a full set of measure gates");
+    }
+    if (qc.is_dynamic()){
+      ERROR("get_probs: The circuit measures as it runs, and so only has counts and memory");
+    }
+
+    update();
+    if (!have_probs){
+      if (buffers){
+        buffers->take(probs, ket.size());
+      }
+      probs.resize(ket.size());
+      for (size_t j=0; j<ket.size(); j++){
+        // squared in P, so that the mixed precision sums are done in double
+        P re = ket[j].real(), im = ket[j].imag();
+        probs[j] = re*re + im*im;
+      }
+      if (!readout.empty()){
+        readout.apply(probs, (qc.nQubits>=parallel_qubits) ? get_pool() : NULL);
+      }
+      have_probs = true;
+    }
+
+    return probs;
+  }
+
+  // the table is built once, after which each shot takes constant time
+  const AliasTable &get_table () {
+    const vector<P> &p = get_probs();
+    if (!have_table){
+      table.build(p);
+      have_table = true;
+    }
+    return table;
+  }
+
+  // circuits that measure as they run (see QuantumCircuit::is_dynamic) are simulated as a tree of branches. at each measure
+  // or reset the shots are split between the outcomes by a binomial draw, and each outcome that gets shots carries on with
+  // its own collapsed copy of the ket. so each branch is simulated once, however many shots take it.
+  // the copies are kept here from one branch and run to the next
+  vector<vector<complex<R>>> spare_kets;
+  map<size_t, int> branch_counts;
+
+  // the probability of a measurement outcome is summed over blocks of this many amplitudes, and then the blocks are
+  // summed in order, so that the result does not depend on the number of threads
+  static const size_t SUM_BLOCK = 1<<12;
+
+  // Gives the probability that measuring qubit q gives 1.
+  double one_probability (const vector<complex<R>> &k, int q, WorkerPool *pool) {
+    size_t half = k.size()/2, bit = size_t(1)<<q;
+    size_t blocks = (half+SUM_BLOCK-1)/SUM_BLOCK;
+    vector<double> partial (blocks);
+    auto sum_blocks = [&](size_t begin, size_t end){
+      for (size_t b=begin; b<end; b++){
+        double sum = 0;
+        size_t last = min(half,(b+1)*SUM_BLOCK);
+        for (size_t i=b*SUM_BLOCK; i<last; i++){
+          sum += norm(k[insert_zero_bit(i,q)|bit]);
+        }
+        partial[b] = sum;
+      }
+    };
+    if (pool && blocks>1){
+      pool->run(blocks, 1, sum_blocks);
+    } else {
+      sum_blocks(0, blocks);
+    }
+    double p1 = 0;
+    for (size_t b=0; b<blocks; b++){
+      p1 += partial[b];
+    }
+    return min(1.0,max(0.0,p1));
+  }
+
+  // Keeps the part of the ket in which qubit q has the given outcome, which has probability p, and renormalizes it.
+  // For a reset an outcome of 1 is then flipped back to 0. Either way this is a single 2x2 matrix, and so one sweep.
+  void collapse (vector<complex<R>> &k, int q, int outcome, double p, bool reset, WorkerPool *pool) {
+    if (p==1.0 && !(reset && outcome==1)){
+      return;
+    }
+    FusedGate gate;
+    gate.kind = FusedGate::SINGLE;
+    gate.q0 = q;
+    gate.q1 = -1;
+    fill(gate.m, gate.m+4, complex<double>(0.0));
+    gate.m[ (outcome==0) ? 0 : (reset ? 1 : 3) ] = 1/sqrt(p);
+    apply_fused(gate, k.data(), k.size(), pool);
+  }
+
+  // Applies the gates in fused to the ket k, as simulate does.
+  void apply_gates (vector<complex<R>> &k, WorkerPool *pool) {
+    if (tile_qubits>0 && qc.nQubits>=blocked_qubits && qc.nQubits>tile_qubits){
+      run_blocked(qc, k.data(), qc.nQubits, fused, tile_qubits, pool);
+      return;
+    }
+    for (size_t g=0; g<fused.size(); g++){
+      if (fused[g].kind==FusedGate::INIT){
+        apply_init(qc, fused[g], k.data(), k.size());
+      } else {
+        apply_fused(fused[g], k.data(), k.size(), pool);
+      }
+    }
+  }
+
+  // Runs the circuit from gate number g on the ket k for the given number of shots, given the classical bits written so far.
+  // The measures from number tail onwards end the circuit, and are sampled from the final ket as usual.
+  // The outcomes of the shots are added to branch_counts.
+  void run_branch (vector<complex<R>> &k, size_t g, size_t tail, int count, unsigned long long bits, WorkerPool *pool) {
+    while (g<tail){
+      // the gates up to the next measure, reset or condition are fused and applied as usual
+      size_t stop = g;
+      while (stop<tail && qc.data[stop].gate!=QuantumCircuit::M && qc.data[stop].gate!=QuantumCircuit::RST && qc.data[stop].cbit<0){
+        stop++;
+      }
+      if (stop>g){
+        fuse_gates(qc, fused, fusion, g, stop);
+        apply_gates(k, pool);
+        g = stop;
+        continue;
+      }
+      const QuantumCircuit::Op &op = qc.data[g];
+      g++;
+      if (op.cbit>=0){
+        if (int((bits>>op.cbit)&1)==op.cvalue){
+          FusedGate gate;
+          op_gate(qc, op, gate);
+          apply_fused(gate, k.data(), k.size(), pool);
+        }
+        continue;
+      }
+      // for M the qubit is the control, and for RST too
+      int q = op.control;
+      bool reset = (op.gate==QuantumCircuit::RST);
+      double p1 = one_probability(k, q, pool);
+      binomial_distribution<int> binomial (count, p1);
+      int ones = (p1<=0) ? 0 : (p1>=1) ? count : binomial(rng);
+      unsigned long long mask = reset ? 0 : 1ULL<<op.target;
+      if (ones>0 && ones<count){
+        // the shots that measured 0 take a copy, and those that measured 1 carry on with k
+        vector<complex<R>> branch;
+        if (!spare_kets.empty()){
+          branch.swap(spare_kets.back());
+          spare_kets.pop_back();
+        }
+        branch.assign(k.begin(), k.end());
+        collapse(branch, q, 0, 1-p1, reset, pool);
+        run_branch(branch, g, tail, count-ones, bits & ~mask, pool);
+        spare_kets.push_back(vector<complex<R>>());
+        spare_kets.back().swap(branch);
+      }
+      int outcome = (ones>0) ? 1 : 0;
+      collapse(k, q, outcome, outcome ? p1 : 1-p1, reset, pool);
+      bits = outcome ? (bits | mask) : (bits & ~mask);
+      if (ones>0){
+        count = ones;
+      }
+    }
+    // the final measures write the bits of a sampled outcome
+    unsigned long long written = 0;
+    for (size_t t=tail; t<qc.data.size(); t++){
+      written |= 1ULL<<qc.data[t].target;
+    }
+    if (written==0){
+      branch_counts[bits] += count;
+      return;
+    }
+    sample_counts_of(k.size(), [&k](size_t j){ return double(norm(k[j])); }, count, rng, sampled);
+    for (size_t j=0; j<sampled.size(); j++){
+      unsigned long long out = bits & ~written;
+      for (size_t t=tail; t<qc.data.size(); t++){
+        out |= ((sampled[j].first>>qc.data[t].control)&1ULL)<<qc.data[t].target;
+      }
+      branch_counts[out] += sampled[j].second;
+    }
+  }
+
+  // Simulates a circuit that measures as it runs, and puts the counts of the classical bits in counts, in order.
+  void run_dynamic (vector<pair<size_t, int>> &counts) {
+    if (!readout.empty()){
+      ERROR("get_counts: Readout errors are not supported for circuits that measure as they run");
+    }
+    if (qc.nBits>64){
+      ERROR("get_counts: Circuits that measure as they run can have at most 64 bits");
+    }
+    // the final measures are those after the last reset, conditioned gate or other gate
+    size_t tail = qc.data.size();
+    while (tail>0 && qc.data[tail-1].gate==QuantumCircuit::M){
+      tail--;
+    }
+    WorkerPool *pool = (qc.nQubits>=parallel_qubits) ? get_pool() : NULL;
+    vector<complex<R>> k;
+    if (!spare_kets.empty()){
+      k.swap(spare_kets.back());
+      spare_kets.pop_back();
+    }
+    reset_ket(k, qc.nQubits);
+    branch_counts.clear();
+    if (shots>0){
+      run_branch(k, 0, tail, shots, 0, pool);
+    }
+    spare_kets.push_back(vector<complex<R>>());
+    spare_kets.back().swap(k);
+    counts.assign(branch_counts.begin(), branch_counts.end());
+  }
+
+  public:
+
+    QuantumCircuit qc;
+    int shots;
+
+    BasicSimulator (const QuantumCircuit &qc_in, int shots_in = 1024) {
+      // unless set_seed is used, the seed differs for every Simulator
+      set_seed(default_seed());
+      qc = qc_in;
+      shots = shots_in;
+      threads = 1;
+      parallel_qubits = 14;
+      fusion = true;
+      have_ket = have_probs = have_table = false;
+      // tiles of 512 kB
+      tile_qubits = 19;
+      for (size_t b=sizeof(complex<R>); b>1; b/=2){
+        tile_qubits--;
+      }
+      blocked_qubits = 20;
+    }
+
+    ~BasicSimulator () {
+      if (buffers){
+        buffers->give(ket);
+        buffers->give(probs);
+      }
+    }
+
+    // Draws the ket and probabilities from the given pool, and gives them back to it when this Simulator is destroyed.
+    void set_buffers (const shared_ptr<BufferPool> &pool) {
+      buffers = pool;
+    }
+
+    // Replaces the circuit, and forgets the results for the old one.
+    void set_circuit (const QuantumCircuit &qc_in) {
+      qc = qc_in;
+      invalidate();
+      snapshots.clear();
+    }
+
+    // Forgets the stored results, so that the next query simulates qc again from the start.
+    // Changes to the gates of qc are noticed automatically, and only the gates from the first change onwards are simulated
+    // again, starting from the latest snapshot before it.
+    void invalidate () {
+      have_ket = have_probs = have_table = false;
+    }
+
+    // Sets the values of the circuit's parameters, and forgets the results for the old values.
+    void bind (const vector<double> &values) {
+      qc.bind(values);
+      invalidate();
+      snapshots.clear();
+    }
+
+    // Gives the statevector for each of the given sets of parameter values, in one call.
+    // With set_threads, small circuits are shared out between the workers with one set per task, and larger circuits
+    // use the workers within each simulation as usual. The stored results for the currently bound values are untouched.
+    vector<vector<complex<R>>> get_statevectors (const vector<vector<double>> &sets) {
+      verify_static(qc, "get_statevectors");
+      vector<vector<complex<R>>> kets (sets.size());
+      bool large = (qc.nQubits>=parallel_qubits);
+      WorkerPool *pool = get_pool();
+      auto run_sets = [&](size_t begin, size_t end){
+        QuantumCircuit bound = qc;
+        for (size_t j=begin; j<end; j++){
+          bound.bind(sets[j]);
+          reset_ket(kets[j], qc.nQubits);
+          run_gates(bound, kets[j], 0, fusion, large ? pool : NULL);
+        }
+      };
+      if (pool && !large){
+        pool->run(sets.size(), 1, run_sets);
+      } else {
+        run_sets(0, sets.size());
+      }
+      return kets;
+    }
+
+    // Stores the state for the circuit as it is now, for cheap undo. If gates are later removed from the end of qc, the state
+    // is restored from the latest snapshot before them, rather than simulating from the start.
+    void snapshot () {
+      update();
+      snapshots[simulated_gates] = ket;
+    }
+
+    void clear_snapshots () {
+      snapshots.clear();
+    }
+
+    // Fixes the random numbers used for sampling, so that results can be reproduced.
+    // The same seed gives the same results for any number of threads.
+    void set_seed (unsigned long long seed) {
+      rng.set_seed(seed);
+    }
+
+    // Gates are merged before simulation by default (see fuse_gates). This can be turned off to apply them exactly as given.
+    void set_fusion (bool on) {
+      if (on!=fusion){
+        invalidate();
+        snapshots.clear();
+      }
+      fusion = on;
+    }
+
+    // Opts in to applying each gate with n threads, for circuits with at least min_qubits qubits.
+    // The threads are started on the first simulation that uses them, and shared by copies of this Simulator.
+    void set_threads (int n, int min_qubits = 14) {
+      if (n<1){
+        ERROR("set_threads: The number of threads must be at least 1");
+      }
+      threads = n;
+      parallel_qubits = min_qubits;
+    }
+
+    // For circuits of at least min_qubits qubits, runs of gates on the lowest tile_qubits qubits are applied a tile of
+    // 2^tile_qubits amplitudes at a time (see run_blocked). The tiles are sized to stay in cache, so that the ket is read
+    // from memory once per run of gates rather than once per gate. By default the tiles are 512 kB, for 20 qubits or more.
+    // A tile_qubits of 0 turns this off.
+    void set_blocking (int tile_qubits_in, int min_qubits = 20) {
+      tile_qubits = tile_qubits_in;
+      blocked_qubits = min_qubits;
+    }
+
+    // The circuit is only simulated on the first query, and later queries reuse the result.
+    const vector<complex<R>> &get_statevector () {
+      if (qc.is_dynamic()){
+        ERROR("get_statevector: The circuit measures as it runs, and so has no single statevector");
+      }
+      // the simulated ket already has the right layout, so it is returned as is
+      update();
+      return ket;
+    }
+
+    // Applies the given errors in reading out the qubits to the probabilities, and so to all the sampled results.
+    // The statevector is unchanged. An empty ReadoutError turns this off.
+    void set_readout_error (const ReadoutError &readout_in) {
+      if (!readout_in.empty() && readout_in.num_qubits()!=qc.nQubits){
+        ERROR("set_readout_error: There should be an error for each qubit");
+      }
+      readout = readout_in;
+      have_probs = have_table = false;
+    }
+
+    // Gives the matrix of the circuit's gates, built with the same fusion and threads as the statevector. See Unitary.
+    Unitary get_unitary () {
+      return Unitary(qc, fusion, (2*qc.nQubits>=parallel_qubits) ? get_pool() : NULL);
+    }
+
+    vector<string> get_memory () {
+      vector<string> memory;
+      get_memory(memory);
+      return memory;//e.g. <"10","10","10","10","10","10","10","10","10","10">
+    }
+
+    // As above, but into the given vector. The strings already in it are reused, so repeated calls need no new memory.
+    void get_memory (vector<string> &memory) {
+
+      if (qc.is_dynamic()){
+        // the counts are drawn branch by branch, and then written out as shots in a random order
+        run_dynamic(sampled);
+        memory.resize(shots);
+        int s = 0;
+        for (size_t j=0; j<sampled.size(); j++){
+          for (int c=0; c<sampled[j].second; c++){
+            bitstring(sampled[j].first, memory[s++]);
+          }
+        }
+        for (int j=shots-1; j>0; j--){
+          swap(memory[j], memory[min(j,int(rng.uniform()*(j+1)))]);
+        }
+        return;
+      }
+
+      const AliasTable &table = get_table();
+
+      // block b of the shots uses the stream found by jumping b times from base.
+      // the generator itself is moved on by a long jump, so that every call gives new results
+      Xoshiro256 base = rng;
+      rng.long_jump();
+
+      memory.resize(shots);
+      int blocks = (shots+SHOT_BLOCK-1)/SHOT_BLOCK;
+      auto sample_blocks = [&](size_t begin, size_t end){
+        Xoshiro256 stream = base;
+        for (size_t b=0; b<begin; b++){
+          stream.jump();
+        }
+        for (size_t b=begin; b<end; b++){
+          Xoshiro256 block = stream;
+          int last = min(shots,int(b+1)*SHOT_BLOCK);
+          for (int s=b*SHOT_BLOCK; s<last; s++){
+            bitstring(table.sample(block.uniform()), memory[s]);
+          }
+          stream.jump();
+        }
+      };
+      WorkerPool *pool = (blocks>1) ? get_pool() : NULL;
+      if (pool){
+        pool->run(blocks, 1, sample_blocks);
+      } else {
+        sample_blocks(0,blocks);
+      }
+
+    }
+
+    // Gives the counts for each outcome that occurred, keyed by the integer whose binary form is the output bit string.
+    // They are drawn as one multinomial sample (see sample_counts), so there is no per-shot work.
+    // For a circuit that measures as it runs, the output is the bits as they are at the end, and the shots are split
+    // between the branches at each measure (see run_branch), so the work is per branch rather than per shot.
+    map<size_t, int> get_int_counts () {
+
+      get_int_counts(sampled);
+
+      return map<size_t, int>(sampled.begin(), sampled.end());
+    }
+
+    // As above, but as (outcome, count) pairs in order of outcome, put in the given vector to reuse its memory.
+    void get_int_counts (vector<pair<size_t, int>> &counts) {
+      if (qc.is_dynamic()){
+        run_dynamic(counts);
+      } else {
+        sample_counts(get_probs(), shots, rng, counts);
+      }
+    }
+
+    // Gives the output bit string for the outcome j, with bit 0 on the right.
+    string bitstring (size_t j) const {
+      string out;
+      bitstring(j, out);
+      return out;
+    }
+
+    void bitstring (size_t j, string &out) const {
+      ::bitstring(j, qc.nQubits, out);
+    }
+
+    map<string, int> get_counts () {
+
+      // only the outcomes that occurred are turned into strings
+      map<string, int> counts;
+      get_int_counts(sampled);
+      for (size_t j=0; j<sampled.size(); j++){
+        counts[bitstring(sampled[j].first)] = sampled[j].second;
+      }
+      
+      return counts;
+    }
+
+    string get_qiskit () {
+      string qiskitPy;
+
+      if (qc.nBits==0){
+        qiskitPy += "qc = QuantumCircuit("+to_string(qc.nQubits)+")\n";
+      } else {
+        qiskitPy += "qc = QuantumCircuit("+to_string(qc.nQubits)+","+to_string(qc.nBits)+")\n";
+      }
+
+      for (int g=0; g<qc.data.size(); g++){
+          const QuantumCircuit::Op &op = qc.data[g];
+          string c = to_string(op.control);
+          string t = to_string(op.target);
+          if (op.gate==QuantumCircuit::X){
+            qiskitPy += "qc.x("+t+")\n";
+          } else if (op.gate==QuantumCircuit::RX) {
+            qiskitPy += "qc.rx("+number_string(qc.angle(op))+","+t+")\n";
+          } else if (op.gate==QuantumCircuit::H) {
+            qiskitPy += "qc.h("+t+")\n";
+          } else if (op.gate==QuantumCircuit::CX) {
+            qiskitPy += "qc.cx("+c+","+t+")\n";
+          } else if (op.gate==QuantumCircuit::CH) {
+            qiskitPy += "qc.ch("+c+","+t+")\n";
+          } else if (op.gate==QuantumCircuit::CRX) {
+            qiskitPy += "qc.crx("+number_string(qc.angle(op))+","+c+","+t+")\n";
+          } else if (op.gate==QuantumCircuit::RZ) {
+            qiskitPy += "qc.rz("+number_string(qc.angle(op))+","+t+")\n";
+          } else if (op.gate==QuantumCircuit::RY) {
+            qiskitPy += "qc.ry("+number_string(qc.angle(op))+","+t+")\n";
+          } else if (op.gate==QuantumCircuit::Z) {
+            qiskitPy += "qc.z("+t+")\n";
+          } else if (op.gate==QuantumCircuit::Y) {
+            qiskitPy += "qc.y("+t+")\n";
+          } else if (op.gate==QuantumCircuit::U) {
+            qiskitPy += "qc.u("+number_string(qc.angle(op))+","+number_string(qc.op_data[op.control])+","+number_string(qc.op_data[op.control+1])+","+t+")\n";
+          } else if (op.gate==QuantumCircuit::CRZ) {
+            qiskitPy += "qc.crz("+number_string(qc.angle(op))+","+c+","+t+")\n";
+          } else if (op.gate==QuantumCircuit::SWAP) {
+            qiskitPy += "qc.swap("+c+","+t+")\n";
+          } else if (op.gate==QuantumCircuit::M) {
+            qiskitPy += "qc.measure("+c+","+t+")\n";
+          } else if (op.gate==QuantumCircuit::RST) {
+            qiskitPy += "qc.reset("+c+")\n";
+          } else if (op.gate==QuantumCircuit::INIT) {
+            qiskitPy += "qc.initialize({"+number_string(qc.op_data[op.target]);
+
+            int initsize = op.control;
+            for(int i=1; i<initsize; i++){
+              qiskitPy += ","+number_string(qc.op_data[op.target+i]);
+            }
+            qiskitPy += "})\n";
+          }
+          if (op.cbit>=0){
+            qiskitPy.insert(qiskitPy.size()-1, ".c_if("+to_string(op.cbit)+","+to_string(op.cvalue)+")");
+          }
+      }
+
+      return qiskitPy;
+    }
+
+    string get_qasm () {
+      string qasm;
+      // initial qasm header
+      qasm += "OPENQASM 2.0;\ninclude \"qelib1.inc\";\n";
+      // qreg
+      qasm += "qreg q["+to_string(qc.nQubits)+"];\n";
+      // creg
+      if (qc.nBits!=0){ // maybe don't do this and always print it
+        qasm += "creg c["+to_string(qc.nBits)+"];\n"; 
+      }
+      // gates
+      for (int g=0; g<qc.data.size(); g++){
+          const QuantumCircuit::Op &op = qc.data[g];
+          string c = to_string(op.control);
+          string t = to_string(op.target);
+          if (op.cbit>=0){
+            ERROR("get_qasm: OpenQASM 2 can only condition gates on a whole register, and not on a single bit");
+          }
+          if (op.gate==QuantumCircuit::X){
+            qasm += "x q["+t+"];\n";
+          } else if (op.gate==QuantumCircuit::RX) {
+            qasm += "rx("+number_string(qc.angle(op))+") q["+t+"];\n";
+          } else if (op.gate==QuantumCircuit::H) {
+            qasm += "h q["+t+"];\n";
+          } else if (op.gate==QuantumCircuit::CX) {
+            qasm += "cx q["+c+"],q["+t+"];\n";
+          } else if (op.gate==QuantumCircuit::CH) {
+            qasm += "ch q["+c+"],q["+t+"];\n";
+          } else if (op.gate==QuantumCircuit::CRX) {
+            qasm += "crx("+number_string(qc.angle(op))+") q["+c+"],q["+t+"];\n";
+          } else if (op.gate==QuantumCircuit::RZ) {
+            qasm += "rz("+number_string(qc.angle(op))+") q["+t+"];\n";
+          } else if (op.gate==QuantumCircuit::RY) {
+            qasm += "ry("+number_string(qc.angle(op))+") q["+t+"];\n";
+          } else if (op.gate==QuantumCircuit::Z) {
+            qasm += "z q["+t+"];\n";
+          } else if (op.gate==QuantumCircuit::Y) {
+            qasm += "y q["+t+"];\n";
+          } else if (op.gate==QuantumCircuit::U) {
+            qasm += "u3("+number_string(qc.angle(op))+","+number_string(qc.op_data[op.control])+","+number_string(qc.op_data[op.control+1])+") q["+t+"];\n";
+          } else if (op.gate==QuantumCircuit::CRZ) {
+            qasm += "crz("+number_string(qc.angle(op))+") q["+c+"],q["+t+"];\n";
+          } else if (op.gate==QuantumCircuit::SWAP) {
+            qasm += "swap q["+c+"],q["+t+"];\n";
+          } else if (op.gate==QuantumCircuit::M) {
+            qasm += "measure q["+c+"] -> c["+t+"];\n";
+          } else if (op.gate==QuantumCircuit::RST) {
+            qasm += "reset q["+c+"];\n";
+          }
+      }
+
+      return qasm;
+    }
+
+};
+
+typedef BasicSimulator<double> Simulator;
+// Halves the memory of the ket, which fits one more qubit in the same space, and doubles the amplitudes per SIMD register.
+// The gates are still fused in double, and rounded to float once per gate.
+typedef BasicSimulator<float> FloatSimulator;
+// Simulates in float as above, but works out and sums the probabilities in double for sampling.
+typedef BasicSimulator<float, double> MixedSimulator;
+
+// Simulates many circuits in one call, with one circuit per task on a shared pool of worker threads.
+// This suits large numbers of small circuits, for which splitting each gate between threads would cost more than it saves.
+// Threads take the next circuit as they finish, so circuits of different sizes are still shared out evenly.
+// Each thread keeps its buffers from one circuit and call to the next, so a long running process reaches a steady state
+// in which simulating a batch allocates nothing beyond the results.
+class BatchSimulator {
+
+  public:
+
+    BatchSimulator (int threads_in = 1) {
+      if (threads_in<1){
+        ERROR("BatchSimulator: The number of threads must be at least 1");
+      }
+      threads = threads_in;
+      fusion = true;
+      rng.set_seed(default_seed());
+      kets.resize(threads);
+      probs.resize(threads);
+      fused.resize(threads);
+    }
+
+    // As for Simulator. The results for a given seed do not depend on the number of threads.
+    void set_seed (unsigned long long seed) {
+      rng.set_seed(seed);
+    }
+
+    void set_fusion (bool on) {
+      fusion = on;
+    }
+
+    // Sets results[j] to the statevector of circuits[j]. Vectors already in results are reused.
+    void get_statevectors (const QuantumCircuit *circuits, size_t count, vector<vector<complex<double>>> &results) {
+      for (size_t j=0; j<count; j++){
+        verify_static(circuits[j], "get_statevectors: Circuit "+to_string(j));
+      }
+      results.resize(count);
+      for_each(count, [&](int w, size_t j){
+        reset_ket(results[j], circuits[j].nQubits);
+        run_gates(circuits[j], results[j], 0, fusion, NULL, fused[w]);
+      });
+    }
+
+    void get_statevectors (const vector<QuantumCircuit> &circuits, vector<vector<complex<double>>> &results) {
+      get_statevectors(circuits.data(), circuits.size(), results);
+    }
+
+    // Sets results[j] to the counts for circuits[j] as (outcome, count) pairs, as given by Simulator::get_int_counts.
+    // Vectors already in results are reused.
+    void get_counts (const QuantumCircuit *circuits, size_t count, int shots, vector<vector<pair<size_t, int>>> &results) {
+      for (size_t j=0; j<count; j++){
+        if(!circuits[j].has_measurements()){
+          ERROR("get_counts: Circuit "+to_string(j)+" should have a full set of measure gates");
+        }
+        verify_static(circuits[j], "get_counts: Circuit "+to_string(j));
+      }
+      results.resize(count);
+      // circuit j of this call gets its own generator, made from this call's seed and j
+      unsigned long long seed = rng();
+      for_each(count, [&](int w, size_t j){
+        vector<complex<double>> &ket = kets[w];
+        vector<double> &p = probs[w];
+        reset_ket(ket, circuits[j].nQubits);
+        run_gates(circuits[j], ket, 0, fusion, NULL, fused[w]);
+        p.resize(ket.size());
+        for (size_t i=0; i<ket.size(); i++){
+          p[i] = norm(ket[i]);
+        }
+        Xoshiro256 stream (seed + j*0xd1b54a32d192ed03ULL);
+        sample_counts(p, shots, stream, results[j]);
+      });
+    }
+
+    void get_counts (const vector<QuantumCircuit> &circuits, int shots, vector<vector<pair<size_t, int>>> &results) {
+      get_counts(circuits.data(), circuits.size(), shots, results);
+    }
+
+  private:
+
+    int threads;
+    bool fusion;
+    Xoshiro256 rng;
+    unique_ptr<WorkerPool> workers;
+    vector<vector<complex<double>>> kets; // one for each thread
+    vector<vector<double>> probs;
+    vector<vector<FusedGate>> fused;
+
+    // Calls f(w,j) for every circuit j, where w is the thread that does it.
+    void for_each (size_t count, const function<void(int,size_t)> &f) {
+      if (threads==1 || count<=1){
+        for (size_t j=0; j<count; j++){
+          f(0,j);
+        }
+        return;
+      }
+      if (!workers){
+        workers.reset(new WorkerPool(threads));
+      }
+      atomic<size_t> next (0);
+      workers->run_indexed(threads, 1, [&](int w, size_t, size_t){
+        for (size_t j=next++; j<count; j=next++){
+          f(w,j);
+        }
+      });
+    }
+
+};
+
+// An open addressing hash map from basis states to amplitudes, for kets with few nonzero amplitudes.
+// Collisions are resolved by linear probing, and the table doubles in size whenever it becomes half full.
+class AmplitudeMap {
+
+  public:
+
+    AmplitudeMap () {
+      keys.assign(16, EMPTY);
+      values.resize(16);
+      count = 0;
+    }
+
+    // Empties the map, keeping its memory.
+    void clear () {
+      fill(keys.begin(), keys.end(), EMPTY);
+      count = 0;
+    }
+
+    // Adds value to the amplitude for the basis state key.
+    void add (unsigned long long key, complex<double> value) {
+      if (2*(count+1)>keys.size()){
+        grow();
+      }
+      size_t j = slot(key);
+      if (keys[j]==EMPTY){
+        keys[j] = key;
+        values[j] = value;
+        count++;
+      } else {
+        values[j] += value;
+      }
+    }
+
+    size_t size () const {
+      return count;
+    }
+
+    // Entries are read by going through the slots from 0 to capacity()-1, skipping those that are not occupied.
+    size_t capacity () const {
+      return keys.size();
+    }
+    bool occupied (size_t j) const {
+      return keys[j]!=EMPTY;
+    }
+    unsigned long long key (size_t j) const {
+      return keys[j];
+    }
+    complex<double> value (size_t j) const {
+      return values[j];
+    }
+
+  private:
+
+    // no ket of 64 qubits can be stored sparsely, so the last basis state is free to mark empty slots
+    enum : unsigned long long { EMPTY = ~0ULL };
+
+    vector<unsigned long long> keys;
+    vector<complex<double>> values;
+    size_t count;
+
+    // the slot holding key, or the empty one where it would go
+    size_t slot (unsigned long long key) const {
+      // the bits are mixed (as in splitmix64) so that nearby basis states are spread over the table
+      unsigned long long h = key;
+      h = (h^(h>>30))*0xbf58476d1ce4e5b9ULL;
+      h = (h^(h>>27))*0x94d049bb133111ebULL;
+      h ^= h>>31;
+      size_t mask = keys.size()-1;
+      size_t j = h&mask;
+      while (keys[j]!=EMPTY && keys[j]!=key){
+        j = (j+1)&mask;
+      }
+      return j;
+    }
+
+    void grow () {
+      vector<unsigned long long> old_keys (2*keys.size(), EMPTY);
+      vector<complex<double>> old_values (2*keys.size());
+      old_keys.swap(keys);
+      old_values.swap(values);
+      for (size_t j=0; j<old_keys.size(); j++){
+        if (old_keys[j]!=EMPTY){
+          size_t k = slot(old_keys[j]);
+          keys[k] = old_keys[j];
+          values[k] = old_values[j];
+        }
+      }
+    }
+
+};
+
+// Simulates circuits for which only a few amplitudes are ever nonzero, such as reversible logic made of x, cx and swap
+// with a few other gates. Only the nonzero amplitudes are stored, in an AmplitudeMap, so the number of qubits is limited
+// by the number of nonzero amplitudes rather than by 2^n, up to 63 qubits.
+// Each gate maps every stored amplitude to the one or two (or four) it contributes to, skipping zeros in the matrix, so
+// gates that only permute or change phases never add entries. If the number of entries passes a given fraction of 2^n,
+// the rest of the circuit is simulated with a dense ket instead, as long as that has no more than a given number of qubits.
+class SparseSimulator {
+
+  public:
+
+    QuantumCircuit qc;
+    int shots;
+
+    SparseSimulator (const QuantumCircuit &qc_in, int shots_in = 1024) {
+      rng.set_seed(default_seed());
+      qc = qc_in;
+      shots = shots_in;
+      fusion = true;
+      dense_fraction = 1.0/16;
+      dense_qubits = 30;
+      simulated = dense = false;
+      if (qc.nQubits>63){
+        ERROR("SparseSimulator: At most 63 qubits are supported");
+      }
+    }
+
+    void set_seed (unsigned long long seed) {
+      rng.set_seed(seed);
+    }
+
+    void set_fusion (bool on) {
+      fusion = on;
+      simulated = false;
+    }
+
+    // Switches to a dense ket once more than fraction*2^n amplitudes are nonzero, for circuits of up to max_qubits qubits.
+    // A fraction above 1 never switches.
+    void set_dense_switch (double fraction, int max_qubits = 30) {
+      dense_fraction = fraction;
+      dense_qubits = max_qubits;
+      simulated = false;
+    }
+
+    // Whether the simulation ended up dense.
+    bool is_dense () {
+      update();
+      return dense;
+    }
+
+    // Gives the nonzero amplitudes as (basis state, amplitude) pairs, in order of basis state.
+    vector<pair<size_t, complex<double>>> get_amplitudes () {
+      update();
+      vector<pair<size_t, complex<double>>> amplitudes;
+      if (dense){
+        for (size_t j=0; j<ket.size(); j++){
+          if (!negligible(ket[j])){
+            amplitudes.push_back( make_pair(j,ket[j]) );
+          }
+        }
+      } else {
+        for (size_t j=0; j<amps.capacity(); j++){
+          if (amps.occupied(j) && !negligible(amps.value(j))){
+            amplitudes.push_back( make_pair(size_t(amps.key(j)),amps.value(j)) );
+          }
+        }
+        sort(amplitudes.begin(), amplitudes.end(), [](const pair<size_t, complex<double>> &a, const pair<size_t, complex<double>> &b){ return a.first<b.first; });
+      }
+      return amplitudes;
+    }
+
+    // The full ket, for circuits small enough to store it.
+    vector<complex<double>> get_statevector () {
+      if (qc.nQubits>dense_qubits){
+        ERROR("get_statevector: Too many qubits for a dense statevector (see set_dense_switch)");
+      }
+      update();
+      if (dense){
+        return ket;
+      }
+      vector<complex<double>> full (size_t(1)<<qc.nQubits);
+      for (size_t j=0; j<amps.capacity(); j++){
+        if (amps.occupied(j)){
+          full[amps.key(j)] = amps.value(j);
+        }
+      }
+      return full;
+    }
+
+    map<size_t, int> get_int_counts () {
+      if(!qc.has_measurements()){
+        ERROR("get_int_counts: The circuit should have a full set of measure gates");
+      }
+      vector<pair<size_t, complex<double>>> amplitudes = get_amplitudes();
+      vector<pair<size_t, int>> sampled;
+      sample_counts_of(amplitudes.size(), [&amplitudes](size_t j){ return norm(amplitudes[j].second); }, shots, rng, sampled);
+      map<size_t, int> counts;
+      for (size_t j=0; j<sampled.size(); j++){
+        counts[amplitudes[sampled[j].first].first] = sampled[j].second;
+      }
+      return counts;
+    }
+
+    map<string, int> get_counts () {
+      return counts_to_strings(get_int_counts(), qc.nQubits);
+    }
+
+  private:
+
+    bool fusion, simulated, dense;
+    double dense_fraction;
+    int dense_qubits;
+    Xoshiro256 rng;
+    AmplitudeMap amps, next;
+    vector<complex<double>> ket;
+
+    // amplitudes this small are taken to be cancellations that rounding has left slightly off zero, and are dropped
+    static bool negligible (complex<double> a) {
+      return norm(a)<=1e-30;
+    }
+
+    void update () {
+      if (simulated){
+        return;
+      }
+      simulated = true;
+      dense = false;
+      amps.clear();
+      amps.add(0, 1.0);
+
+      verify_static(qc, "SparseSimulator");
+      vector<FusedGate> fused;
+      fuse_gates(qc, fused, fusion);
+      size_t limit = (qc.nQubits<=dense_qubits && dense_fraction<1) ? size_t(dense_fraction*(size_t(1)<<qc.nQubits)) : size_t(-1);
+
+      for (size_t g=0; g<fused.size(); g++){
+        if (dense){
+          if (fused[g].kind==FusedGate::INIT){
+            apply_init(qc, fused[g], ket.data(), ket.size());
+          } else {
+            apply_fused(fused[g], ket.data(), ket.size(), (WorkerPool*)NULL);
+          }
+          continue;
+        }
+        apply_sparse(fused[g]);
+        if (amps.size()>limit){
+          // too many entries for the map to pay off, so the rest is done densely
+          ket.assign(size_t(1)<<qc.nQubits, complex<double>(0.0,0.0));
+          for (size_t j=0; j<amps.capacity(); j++){
+            if (amps.occupied(j)){
+              ket[amps.key(j)] = amps.value(j);
+            }
+          }
+          dense = true;
+        }
+      }
+    }
+
+    // Applies the gate to the entries of amps, putting the results in next, and then swaps the two.
+    void apply_sparse (const FusedGate &gate) {
+      next.clear();
+      if (gate.kind==FusedGate::INIT){
+        const QuantumCircuit::Op &op = qc.data[gate.q0];
+        size_t initsize = op.control;
+        const double *p = &qc.op_data[op.target];
+        bool complete = (initsize!=(size_t(1)<<qc.nQubits));
+        for (size_t j=0; j<(complete ? initsize/2 : initsize); j++){
+          complex<double> a = complete ? complex<double>(p[2*j],p[2*j+1]) : complex<double>(p[j],0.0);
+          if (a!=0.0){
+            next.add(j, a);
+          }
+        }
+        swap(amps,next);
+        return;
+      }
+      unsigned long long bit0 = 1ULL<<gate.q0;
+      unsigned long long bit1 = (gate.q1>=0) ? 1ULL<<gate.q1 : 0;
+      for (size_t e=0; e<amps.capacity(); e++){
+        if (!amps.occupied(e) || negligible(amps.value(e))){
+          continue;
+        }
+        unsigned long long b = amps.key(e);
+        complex<double> a = amps.value(e);
+        if (gate.kind==FusedGate::SWAP){
+          bool x0 = b&bit0, x1 = b&bit1;
+          next.add( (x0==x1) ? b : b^bit0^bit1, a );
+        } else if (gate.kind==FusedGate::PAIR){
+          // the 4x4 matrix takes the quad element i, given by the two bits, to each element j
+          unsigned long long base = b&~(bit0|bit1);
+          int i = ((b&bit0) ? 1 : 0) | ((b&bit1) ? 2 : 0);
+          for (int j=0; j<4; j++){
+            if (gate.m[4*j+i]!=0.0){
+              next.add( base | ((j&1) ? bit0 : 0) | ((j&2) ? bit1 : 0), gate.m[4*j+i]*a );
+            }
+          }
+        } else if (gate.kind==FusedGate::CONTROLLED && !(b&bit1)){
+          next.add(b, a);
+        } else {
+          unsigned long long base = b&~bit0;
+          int i = (b&bit0) ? 1 : 0;
+          for (int j=0; j<2; j++){
+            if (gate.m[2*j+i]!=0.0){
+              next.add( j ? base|bit0 : base, gate.m[2*j+i]*a );
+            }
+          }
+        }
+      }
+      swap(amps,next);
+    }
+
+};
+
+// A noise channel on one qubit, given by its Kraus operators: rho becomes the sum of K rho K^dagger over them.
+// Each operator is a 2x2 matrix {k00,k01,k10,k11}, as for gates. The usual channels are made by the static functions.
+struct NoiseChannel {
+
+  vector<array<complex<double>, 4>> kraus;
+
+  NoiseChannel () {}
+
+  NoiseChannel (const vector<array<complex<double>, 4>> &kraus_in) {
+    kraus = kraus_in;
+  }
+
+  // With probability p, the qubit is replaced by the fully mixed state. This is I, X, Y and Z with probabilities 1-3p/4 and p/4 each.
+  static NoiseChannel depolarizing (double p) {
+    check(p, "depolarizing");
+    double a = sqrt(1-0.75*p), b = sqrt(0.25*p);
+    complex<double> i (0,1);
+    return NoiseChannel({ {a,0,0,a}, {0,b,b,0}, {0,-i*b,i*b,0}, {b,0,0,-b} });
+  }
+
+  // Decay from 1 to 0 with probability gamma, as for T1.
+  static NoiseChannel amplitude_damping (double gamma) {
+    check(gamma, "amplitude_damping");
+    return NoiseChannel({ {1,0,0,sqrt(1-gamma)}, {0,sqrt(gamma),0,0} });
+  }
+
+  // A Z with probability p, as for T2. Superpositions of 0 and 1 lose a fraction 2p of their coherence.
+  static NoiseChannel dephasing (double p) {
+    check(p, "dephasing");
+    double a = sqrt(1-p), b = sqrt(p);
+    return NoiseChannel({ {a,0,0,a}, {b,0,0,-b} });
+  }
+
+  // Gives the 4x4 matrix that applies the channel to a density matrix, after first applying the gate u if one is given.
+  // It acts on the row bit (bit 0 of the quad index) and column bit (bit 1) of the qubit, in the layout of apply_matrix4:
+  // rho[r][c] becomes the sum of K[r][r'] rho[r'][c'] conj(K[c][c']) over r', c' and the operators K.
+  void superoperator (complex<double> s[16], const complex<double> *u = NULL) const {
+    fill(s, s+16, 0.0);
+    for (size_t o=0; o<kraus.size(); o++){
+      complex<double> k[4];
+      for (int j=0; j<4; j++){
+        k[j] = u ? kraus[o][2*(j/2)]*u[j%2] + kraus[o][2*(j/2)+1]*u[2+j%2] : kraus[o][j];
+      }
+      for (int a=0; a<4; a++){
+        for (int b=0; b<4; b++){
+          s[4*a+b] += k[2*(a&1)+(b&1)]*conj(k[2*(a>>1)+(b>>1)]);
+        }
+      }
+    }
+  }
+
+  private:
+
+    static void check (double p, const string &name) {
+      if (p<0 || p>1){
+        ERROR(name+": The probability should be between 0 and 1");
+      }
+    }
+
+};
+
+// Says which noise channels follow which gates. A channel added for a type of gate acts on each qubit of every gate of
+// that type (so on both qubits of two qubit gates). A channel added for a qubit acts on it after every gate that uses it.
+class NoiseModel {
+
+  public:
+
+    void add_gate_noise (QuantumCircuit::GateOp gate, const NoiseChannel &channel) {
+      by_gate[gate].push_back(channel);
+    }
+
+    void add_qubit_noise (int q, const NoiseChannel &channel) {
+      by_qubit[q].push_back(channel);
+    }
+
+    // Puts the channels that follow op into after, as (qubit, channel) pairs in the order that they are applied.
+    void channels_after (const QuantumCircuit::Op &op, vector<pair<int, const NoiseChannel*>> &after) const {
+      after.clear();
+      if (op.gate==QuantumCircuit::INIT || op.gate==QuantumCircuit::M || op.gate==QuantumCircuit::RST){
+        return;
+      }
+      int qubits[2] = {op.target, op.control};
+      bool two = (op.gate==QuantumCircuit::SWAP || is_controlled(op.gate));
+      for (int j=0; j<(two ? 2 : 1); j++){
+        int q = qubits[j];
+        map<int, vector<NoiseChannel>>::const_iterator g = by_gate.find(op.gate), b = by_qubit.find(q);
+        if (g!=by_gate.end()){
+          for (size_t c=0; c<g->second.size(); c++){
+            after.push_back( make_pair(q, &g->second[c]) );
+          }
+        }
+        if (b!=by_qubit.end()){
+          for (size_t c=0; c<b->second.size(); c++){
+            after.push_back( make_pair(q, &b->second[c]) );
+          }
+        }
+      }
+    }
+
+  private:
+
+    map<int, vector<NoiseChannel>> by_gate, by_qubit;
+
+};
+
+// Simulates a circuit with noise, by evolving its density matrix rho. This takes 4^n amplitudes, so is for up to about 14 qubits.
+// rho is stored as a ket of 2n qubits, with element (r,c) at r + (c<<n). A gate U on qubit q is then U on bit q, for the
+// rows, and conj(U) on bit q+n, for the columns, so the usual gate kernels do the work. A channel on qubit q is a 4x4
+// superoperator on bits q and q+n (see NoiseChannel::superoperator), into which the single qubit gate before it is merged.
+template <typename R>
+class BasicDensityMatrixSimulator {
+
+  public:
+
+    QuantumCircuit qc;
+    NoiseModel noise;
+    int shots;
+
+    BasicDensityMatrixSimulator (const QuantumCircuit &qc_in, const NoiseModel &noise_in = NoiseModel(), int shots_in = 1024) {
+      rng.set_seed(default_seed());
+      qc = qc_in;
+      noise = noise_in;
+      shots = shots_in;
+      threads = 1;
+      fusion = true;
+      simulated = false;
+      // tiles of 512 kB, as for BasicSimulator
+      tile_qubits = 19;
+      for (size_t b=sizeof(complex<R>); b>1; b/=2){
+        tile_qubits--;
+      }
+      if (qc.nQubits>=32){
+        ERROR("DensityMatrixSimulator: Too many qubits for a density matrix");
+      }
+    }
+
+    void set_seed (unsigned long long seed) {
+      rng.set_seed(seed);
+    }
+
+    void set_fusion (bool on) {
+      fusion = on;
+      simulated = false;
+    }
+
+    void set_noise (const NoiseModel &noise_in) {
+      noise = noise_in;
+      simulated = false;
+    }
+
+    // Applies each gate with n threads.
+    void set_threads (int n) {
+      if (n<1){
+        ERROR("set_threads: The number of threads must be at least 1");
+      }
+      threads = n;
+      workers.reset();
+    }
+
+    // Runs of gates are applied a tile of 2^tile_qubits elements at a time (see run_blocked), for 10 qubits or more.
+    // A tile_qubits of 0 turns this off.
+    void set_blocking (int tile_qubits_in) {
+      tile_qubits = tile_qubits_in;
+      simulated = false;
+    }
+
+    // The 4^n elements of rho, with element (r,c) at r + (c<<n).
+    const vector<complex<R>> &get_density_matrix () {
+      update();
+      return rho;
+    }
+
+    // The probability of each outcome, which is the diagonal of rho.
+    vector<double> get_probabilities () {
+      update();
+      size_t dim = size_t(1)<<qc.nQubits;
+      vector<double> probs (dim);
+      for (size_t j=0; j<dim; j++){
+        probs[j] = rho[j*(dim+1)].real();
+      }
+      return probs;
+    }
+
+    map<size_t, int> get_int_counts () {
+      if(!qc.has_measurements()){
+        ERROR("get_int_counts: The circuit should have a full set of measure gates");
+      }
+      update();
+      size_t dim = size_t(1)<<qc.nQubits;
+      const complex<R> *diagonal = rho.data();
+      vector<pair<size_t, int>> sampled;
+      // rounding can leave the diagonal very slightly negative, which counts as zero
+      sample_counts_of(dim, [diagonal,dim](size_t j){ return max(0.0, double(diagonal[j*(dim+1)].real())); }, shots, rng, sampled);
+      return map<size_t, int>(sampled.begin(), sampled.end());
+    }
+
+    map<string, int> get_counts () {
+      return counts_to_strings(get_int_counts(), qc.nQubits);
+    }
+
+  private:
+
+    int threads, tile_qubits;
+    bool fusion, simulated;
+    Xoshiro256 rng;
+    unique_ptr<WorkerPool> workers;
+    vector<complex<R>> rho;
+    vector<FusedGate> program;
+
+    void update () {
+      if (simulated){
+        return;
+      }
+      simulated = true;
+      verify_static(qc, "DensityMatrixSimulator");
+      int n = qc.nQubits;
+      size_t dim = size_t(1)<<n;
+      rho.assign(dim*dim, 0.0);
+
+      // an initialize replaces the state with the pure state |psi><psi|, so everything before the last one is skipped
+      size_t first = last_init(qc);
+      if (first>0){
+        vector<complex<R>> psi (dim);
+        FusedGate init;
+        init.kind = FusedGate::INIT;
+        init.q0 = first-1;
+        apply_init(qc, init, psi.data(), dim);
+        for (size_t c=0; c<dim; c++){
+          for (size_t r=0; r<dim; r++){
+            rho[r+c*dim] = psi[r]*conj(psi[c]);
+          }
+        }
+      } else {
+        rho[0] = 1.0;
+      }
+
+      build_program(first);
+
+      WorkerPool *pool = NULL;
+      if (threads>1 && 2*n>=14){
+        if (!workers){
+          workers.reset(new WorkerPool(threads));
+        }
+        pool = workers.get();
+      }
+      if (tile_qubits>0 && n>=10 && 2*n>tile_qubits){
+        run_blocked(qc, rho.data(), 2*n, program, tile_qubits, pool);
+      } else {
+        for (size_t g=0; g<program.size(); g++){
+          apply_fused(program[g], rho.data(), rho.size(), pool);
+        }
+      }
+    }
+
+    // Turns the circuit into gates on the 2n qubits of rho. The gates between channels are fused as usual, and each then
+    // applied to the rows and the columns. A single qubit gate that is the last in its run to use a qubit is left for the
+    // first channel that follows on that qubit to absorb.
+    void build_program (size_t first) {
+      int n = qc.nQubits;
+      program.clear();
+      vector<FusedGate> fused;
+      vector<pair<int, const NoiseChannel*>> after;
+      size_t start = first;
+      for (size_t g=first; g<qc.data.size(); g++){
+        noise.channels_after(qc.data[g], after);
+        if (after.empty() && g+1<qc.data.size()){
+          continue;
+        }
+        fuse_gates(qc, fused, fusion, start, g+1);
+        start = g+1;
+        // absorbed[q] is the gate on q to merge into its first channel, if any
+        int absorbed[64];
+        fill(absorbed, absorbed+64, -1);
+        for (size_t c=0; c<after.size(); c++){
+          int q = after[c].first;
+          for (int f=int(fused.size())-1; f>=0; f--){
+            if (fused[f].q0==q || fused[f].q1==q){
+              if (fused[f].kind==FusedGate::SINGLE){
+                absorbed[q] = f;
+              }
+              break;
+            }
+          }
+        }
+        for (size_t f=0; f<fused.size(); f++){
+          if (fused[f].kind==FusedGate::SINGLE && absorbed[fused[f].q0]==int(f)){
+            continue;
+          }
+          program.push_back(fused[f]);
+          FusedGate columns = fused[f];
+          columns.q0 += n;
+          if (columns.q1>=0){
+            columns.q1 += n;
+          }
+          for (int j=0; j<16; j++){
+            columns.m[j] = conj(columns.m[j]);
+          }
+          program.push_back(columns);
+        }
+        // all the channels on a qubit are multiplied into one superoperator, which is applied in a single sweep
+        for (size_t c=0; c<after.size(); c++){
+          int q = after[c].first;
+          bool done = false;
+          for (size_t d=0; d<c; d++){
+            done = done || after[d].first==q;
+          }
+          if (done){
+            continue;
+          }
+          FusedGate channel;
+          channel.kind = FusedGate::PAIR;
+          channel.q0 = q;
+          channel.q1 = q+n;
+          after[c].second->superoperator(channel.m, (absorbed[q]>=0) ? fused[absorbed[q]].m : NULL);
+          for (size_t d=c+1; d<after.size(); d++){
+            if (after[d].first==q){
+              complex<double> next[16], product[16];
+              after[d].second->superoperator(next);
+              matrix_product(next, channel.m, product, 4);
+              copy(product, product+16, channel.m);
+            }
+          }
+          program.push_back(channel);
+        }
+      }
+    }
+
+};
+
+typedef BasicDensityMatrixSimulator<double> DensityMatrixSimulator;
+typedef BasicDensityMatrixSimulator<float> FloatDensityMatrixSimulator;
+
+// Simulates a circuit with noise by sampling quantum trajectories: each trajectory is a ket, into which one Kraus operator
+// of each channel is inserted at random, with the probability that it has for the ket at that point. The shots are shared
+// between the trajectories, and each samples its share from its final ket. This needs one ket per thread rather than the
+// 4^n amplitudes of a density matrix, at the cost of statistical error that falls with the number of trajectories.
+// The trajectories are shared out between the threads, each with its own random numbers made from the seed and its number,
+// so the results for a given seed do not depend on the number of threads.
+template <typename R>
+class BasicTrajectorySimulator {
+
+  public:
+
+    QuantumCircuit qc;
+    NoiseModel noise;
+    int shots;
+
+    BasicTrajectorySimulator (const QuantumCircuit &qc_in, const NoiseModel &noise_in = NoiseModel(), int shots_in = 1024) {
+      rng.set_seed(default_seed());
+      qc = qc_in;
+      noise = noise_in;
+      shots = shots_in;
+      threads = 1;
+      trajectories = 64;
+      fusion = true;
+      built = false;
+    }
+
+    void set_seed (unsigned long long seed) {
+      rng.set_seed(seed);
+    }
+
+    void set_fusion (bool on) {
+      fusion = on;
+      built = false;
+    }
+
+    void set_noise (const NoiseModel &noise_in) {
+      noise = noise_in;
+      built = false;
+    }
+
+    // Runs n trajectories at once, one per thread.
+    void set_threads (int n) {
+      if (n<1){
+        ERROR("set_threads: The number of threads must be at least 1");
+      }
+      threads = n;
+      workers.reset();
+      kets.clear();
+    }
+
+    // The number of trajectories the shots are shared between, 64 by default. Using as many as there are shots makes
+    // every shot independent, which is exact but costs a simulation per shot.
+    void set_trajectories (int n) {
+      if (n<1){
+        ERROR("set_trajectories: The number of trajectories must be at least 1");
+      }
+      trajectories = n;
+    }
+
+    map<size_t, int> get_int_counts () {
+      if(!qc.has_measurements()){
+        ERROR("get_int_counts: The circuit should have a full set of measure gates");
+      }
+      build();
+      int count = min(trajectories, max(shots,1));
+      vector<vector<pair<size_t, int>>> results (count);
+      // trajectory t of this call gets its own generator, made from this call's seed and t
+      unsigned long long seed = rng();
+      for_each(count, [&](int w, size_t t){
+        int share = shots/count + (int(t)<shots%count ? 1 : 0);
+        Xoshiro256 stream (seed + t*0xd1b54a32d192ed03ULL);
+        run_trajectory(kets[w], stream);
+        vector<complex<R>> &ket = kets[w];
+        sample_counts_of(ket.size(), [&ket](size_t j){ return norm(complex<double>(ket[j])); }, share, stream, results[t]);
+      });
+      map<size_t, int> counts;
+      for (size_t t=0; t<results.size(); t++){
+        for (size_t j=0; j<results[t].size(); j++){
+          counts[results[t][j].first] += results[t][j].second;
+        }
+      }
+      return counts;
+    }
+
+    map<string, int> get_counts () {
+      return counts_to_strings(get_int_counts(), qc.nQubits);
+    }
+
+  private:
+
+    // a channel on qubit q, ready to be sampled from
+    struct Jump {
+      int q;
+      vector<array<complex<double>, 4>> kraus;
+      // when every operator is a multiple of a unitary, as for depolarizing and dephasing, the probability of each does
+      // not depend on the ket and is given here. otherwise this is empty
+      vector<double> fixed;
+    };
+
+    int threads, trajectories;
+    bool fusion, built;
+    Xoshiro256 rng;
+    unique_ptr<WorkerPool> workers;
+    vector<vector<complex<R>>> kets; // one for each thread
+
+    // the fused gates from the end of one set of channels to the next, and the channels that then follow them
+    vector<FusedGate> gates;
+    vector<size_t> segment_end;
+    vector<vector<Jump>> jumps;
+
+    // Works out the gates and channels of the circuit, which are the same for every trajectory.
+    void build () {
+      if (built){
+        return;
+      }
+      built = true;
+      verify_static(qc, "TrajectorySimulator");
+      gates.clear();
+      segment_end.clear();
+      jumps.clear();
+      vector<FusedGate> fused;
+      vector<pair<int, const NoiseChannel*>> after;
+      // the noise before the last initialize cannot change the result, and so its jumps are skipped
+      size_t start = last_init(qc);
+      start -= (start>0) ? 1 : 0;
+      for (size_t g=start; g<qc.data.size(); g++){
+        noise.channels_after(qc.data[g], after);
+        if (after.empty() && g+1<qc.data.size()){
+          continue;
+        }
+        fuse_gates(qc, fused, fusion, start, g+1);
+        start = g+1;
+        gates.insert(gates.end(), fused.begin(), fused.end());
+        segment_end.push_back(gates.size());
+        jumps.push_back(vector<Jump>());
+        for (size_t c=0; c<after.size(); c++){
+          Jump jump;
+          jump.q = after[c].first;
+          jump.kraus = after[c].second->kraus;
+          // K^dagger K is a multiple of the identity exactly when K is a multiple of a unitary, and the multiple is then the probability
+          bool unitary = true;
+          for (size_t o=0; o<jump.kraus.size(); o++){
+            const array<complex<double>, 4> &k = jump.kraus[o];
+            double d0 = norm(k[0])+norm(k[2]), d1 = norm(k[1])+norm(k[3]);
+            complex<double> off = conj(k[0])*k[1] + conj(k[2])*k[3];
+            unitary = unitary && abs(d0-d1)<1e-12 && abs(off)<1e-12;
+            jump.fixed.push_back(d0);
+          }
+          if (!unitary){
+            jump.fixed.clear();
+          }
+          jumps.back().push_back(jump);
+        }
+      }
+    }
+
+    // Runs one trajectory in ket, drawing the Kraus operators with the given generator.
+    void run_trajectory (vector<complex<R>> &ket, Xoshiro256 &stream) {
+      reset_ket(ket, qc.nQubits);
+      size_t g = 0;
+      for (size_t s=0; s<segment_end.size(); s++){
+        for (; g<segment_end[s]; g++){
+          if (gates[g].kind==FusedGate::INIT){
+            apply_init(qc, gates[g], ket.data(), ket.size());
+          } else {
+            apply_fused(gates[g], ket.data(), ket.size(), (WorkerPool*)NULL);
+          }
+        }
+        for (size_t j=0; j<jumps[s].size(); j++){
+          apply_jump(jumps[s][j], ket, stream);
+        }
+      }
+    }
+
+    // Picks one of the Kraus operators K of the jump with probability |K psi|^2, and applies K/|K psi| to psi.
+    void apply_jump (const Jump &jump, vector<complex<R>> &ket, Xoshiro256 &stream) {
+      int q = jump.q;
+      size_t count = jump.kraus.size();
+      vector<double> prob (count);
+      if (!jump.fixed.empty()){
+        prob = jump.fixed;
       } else {
-        qiskitPy += "qc = QuantumCircuit("+to_string(qc.nQubits)+","+to_string(qc.nBits)+")\n";
+        // the probabilities only depend on the reduced density matrix of the qubit, {{a00,a01},{conj(a01),a11}}, found in one pass
+        double a00 = 0, a11 = 0;
+        complex<double> a01 = 0;
+        size_t tbit = size_t(1)<<q;
+        for (size_t i=0; i<ket.size()/2; i++){
+          size_t b0 = insert_zero_bit(i,q);
+          complex<double> e0 = ket[b0], e1 = ket[b0|tbit];
+          a00 += norm(e0);
+          a11 += norm(e1);
+          a01 += e0*conj(e1);
+        }
+        for (size_t o=0; o<count; o++){
+          const array<complex<double>, 4> &k = jump.kraus[o];
+          prob[o] = 0;
+          for (int r=0; r<2; r++){
+            prob[o] += norm(k[2*r])*a00 + norm(k[2*r+1])*a11 + 2*real(k[2*r]*conj(k[2*r+1])*a01);
+          }
+        }
+      }
+      double total = 0;
+      for (size_t o=0; o<count; o++){
+        total += prob[o];
+      }
+      // the last operator with nonzero probability is taken if rounding leaves the draw just past the end
+      double u = stream.uniform()*total;
+      size_t chosen = count;
+      for (size_t o=0; o<count; o++){
+        if (prob[o]>0){
+          chosen = o;
+          if (u<prob[o]){
+            break;
+          }
+          u -= prob[o];
+        }
+      }
+      if (chosen==count){
+        return;
       }
+      FusedGate gate;
+      gate.kind = FusedGate::SINGLE;
+      gate.q0 = q;
+      gate.q1 = -1;
+      double scale = 1/sqrt(prob[chosen]/total);
+      for (int j=0; j<4; j++){
+        gate.m[j] = jump.kraus[chosen][j]*scale;
+      }
+      // operators that are a multiple of the identity leave the normalized ket as it is
+      if (gate.m[1]==0.0 && gate.m[2]==0.0 && abs(gate.m[0]-1.0)<1e-12 && abs(gate.m[3]-1.0)<1e-12){
+        return;
+      }
+      apply_fused(gate, ket.data(), ket.size(), (WorkerPool*)NULL);
+    }
 
-      for (int g=0; g<qc.data.size(); g++){
-          if (qc.data[g][0]=="x"){
-            qiskitPy += "qc.x("+qc.data[g][1]+")\n";
-          } else if (qc.data[g][0]=="rx") {
-            qiskitPy += "qc.rx("+qc.data[g][1]+","+qc.data[g][2]+")\n";
-          } else if (qc.data[g][0]=="h") {
-            qiskitPy += "qc.h("+qc.data[g][1]+")\n";
-          } else if (qc.data[g][0]=="cx") {
-            qiskitPy += "qc.cx("+qc.data[g][1]+","+qc.data[g][2]+")\n";
-          } else if (qc.data[g][0]=="ch") {
-            qiskitPy += "qc.ch("+qc.data[g][1]+","+qc.data[g][2]+")\n";
-          } else if (qc.data[g][0]=="crx") {
-            qiskitPy += "qc.crx("+qc.data[g][1]+","+qc.data[g][2]+","+qc.data[g][3]+")\n";
-          } else if (qc.data[g][0]=="m") {
-            qiskitPy += "qc.measure("+qc.data[g][1]+","+qc.data[g][2]+")\n";
-          } else if (qc.data[g][0]=="init") {
-            qiskitPy += "qc.initialize({"+qc.data[g][2];
-
-            int initsize = stoi(qc.data[g][1]);
-            for(int i=0; i<initsize-1; i++){
-              qiskitPy += ","+qc.data[g][3+i];
-            }
-            qiskitPy += "})\n";
+    // Calls f(w,t) for every trajectory t, where w is the thread that does it, as in BatchSimulator.
+    void for_each (size_t count, const function<void(int,size_t)> &f) {
+      if (kets.size()!=threads){
+        kets.resize(threads);
+      }
+      if (threads==1 || count<=1){
+        for (size_t t=0; t<count; t++){
+          f(0,t);
+        }
+        return;
+      }
+      if (!workers){
+        workers.reset(new WorkerPool(threads));
+      }
+      atomic<size_t> next (0);
+      workers->run_indexed(threads, 1, [&](int w, size_t, size_t){
+        for (size_t t=next++; t<count; t=next++){
+          f(w,t);
+        }
+      });
+    }
+
+};
+
+typedef BasicTrajectorySimulator<double> TrajectorySimulator;
+typedef BasicTrajectorySimulator<float> FloatTrajectorySimulator;
+
+// The communication between the ranks of a distributed simulation, in the style of MPI. Every rank runs the same program
+// and makes the same calls in the same order. The number of ranks must be a power of 2.
+// An MPI version only needs exchange, as MPI_Sendrecv. LocalTransport is a stand-in that runs the ranks as local processes.
+class Transport {
+
+  public:
+
+    virtual ~Transport () {}
+
+    virtual int rank () const = 0;
+    virtual int size () const = 0;
+
+    // Sends the given bytes from send to the rank partner, and receives as many from it into recv.
+    // The partner makes the matching call.
+    virtual void exchange (int partner, const void *send, void *recv, size_t bytes) = 0;
+
+    // Puts the bytes from send of every rank into recv, in order of rank, so that recv needs room for size()*bytes.
+    // This is done by recursive doubling: at each step, ranks that differ in one bit swap everything they have so far.
+    virtual void all_gather (const void *send, void *recv, size_t bytes) {
+      char *out = static_cast<char*>(recv);
+      memcpy(out+rank()*bytes, send, bytes);
+      for (int bit=1; bit<size(); bit*=2){
+        int partner = rank()^bit;
+        size_t have = bit*bytes;
+        size_t mine = (rank()&~(bit-1))*bytes;
+        size_t theirs = (partner&~(bit-1))*bytes;
+        exchange(partner, out+mine, out+theirs, have);
+      }
+    }
+
+};
+
+// Simulates a circuit with its ket split between the ranks of a Transport, so that each holds 2^(n-k) amplitudes for
+// 2^k ranks. Rank r holds the amplitudes whose top k bits are r, so the top k qubits are global and the rest local.
+// Gates on local qubits are done by each rank alone. A gate on a global qubit first swaps it with a local qubit (chosen
+// as in run_blocked), for which each rank trades half its amplitudes with one other. The layout is restored at the end.
+template <typename R>
+class BasicDistributedSimulator {
+
+  public:
+
+    QuantumCircuit qc;
+    int shots;
+
+    BasicDistributedSimulator (const QuantumCircuit &qc_in, Transport &transport_in, int shots_in = 1024) : transport(transport_in) {
+      qc = qc_in;
+      shots = shots_in;
+      fusion = true;
+      have_ket = false;
+      global = 0;
+      while ((1<<global)<transport.size()){
+        global++;
+      }
+      if ((1<<global)!=transport.size()){
+        ERROR("DistributedSimulator: The number of ranks must be a power of 2");
+      }
+      local = qc.nQubits-global;
+      if (local<2){
+        ERROR("DistributedSimulator: Each rank needs at least 2 qubits' worth of amplitudes");
+      }
+      rng.set_seed(default_seed());
+    }
+
+    // The seed of rank 0 is used for everything but the sampling within each rank, so only it needs to be set.
+    void set_seed (unsigned long long seed) {
+      rng.set_seed(seed);
+    }
+
+    void set_fusion (bool on) {
+      fusion = on;
+      have_ket = false;
+    }
+
+    // The amplitudes held by this rank, which are those from number offset() onwards.
+    const vector<complex<R>> &get_local_statevector () {
+      if (!have_ket){
+        simulate();
+        have_ket = true;
+      }
+      return ket;
+    }
+
+    size_t offset () const {
+      return size_t(transport.rank())<<local;
+    }
+
+    // Gathers the whole ket on every rank. This is only for circuits small enough to fit on one.
+    vector<complex<R>> get_statevector () {
+      const vector<complex<R>> &mine = get_local_statevector();
+      vector<complex<R>> all (size_t(1)<<qc.nQubits);
+      transport.all_gather(mine.data(), all.data(), mine.size()*sizeof(complex<R>));
+      return all;
+    }
+
+    // Gives the same counts on every rank. The shots are first shared between the ranks according to the total probability
+    // on each, and each then samples its own from its amplitudes.
+    map<size_t, int> get_int_counts () {
+
+      if(!qc.has_measurements()){
+        ERROR("get_int_counts: The circuit should have a full set of measure gates");
+      }
+      const vector<complex<R>> &mine = get_local_statevector();
+      int ranks = transport.size();
+
+      double total = 0;
+      for (size_t j=0; j<mine.size(); j++){
+        total += norm(complex<double>(mine[j]));
+      }
+      vector<double> totals (ranks);
+      transport.all_gather(&total, totals.data(), sizeof(double));
+      unsigned long long seed = rng();
+      vector<unsigned long long> seeds (ranks);
+      transport.all_gather(&seed, seeds.data(), sizeof(seed));
+
+      // every rank makes the same split, from the seed of rank 0
+      Xoshiro256 shared (seeds[0]);
+      vector<pair<size_t, int>> split;
+      sample_counts(totals, shots, shared, split);
+      int my_shots = 0;
+      for (size_t j=0; j<split.size(); j++){
+        if (split[j].first==transport.rank()){
+          my_shots = split[j].second;
+        }
+      }
+
+      Xoshiro256 stream (seeds[0] + (transport.rank()+1)*0xd1b54a32d192ed03ULL);
+      vector<pair<size_t, int>> sampled;
+      sample_counts_of(mine.size(), [&mine](size_t j){ return norm(complex<double>(mine[j])); }, my_shots, stream, sampled);
+
+      // the outcomes of all ranks are gathered, padded to the longest list
+      unsigned long long found = sampled.size(), most = 0;
+      vector<unsigned long long> founds (ranks);
+      transport.all_gather(&found, founds.data(), sizeof(found));
+      for (int r=0; r<ranks; r++){
+        most = max(most, founds[r]);
+      }
+      vector<unsigned long long> outcomes (2*most), all_outcomes (2*most*ranks);
+      for (size_t j=0; j<sampled.size(); j++){
+        outcomes[2*j] = offset() + sampled[j].first;
+        outcomes[2*j+1] = sampled[j].second;
+      }
+      transport.all_gather(outcomes.data(), all_outcomes.data(), 2*most*sizeof(unsigned long long));
+
+      map<size_t, int> counts;
+      for (int r=0; r<ranks; r++){
+        for (size_t j=0; j<founds[r]; j++){
+          counts[all_outcomes[2*(r*most+j)]] = all_outcomes[2*(r*most+j)+1];
+        }
+      }
+      return counts;
+    }
+
+    map<string, int> get_counts () {
+      return counts_to_strings(get_int_counts(), qc.nQubits);
+    }
+
+  private:
+
+    Transport &transport;
+    int global, local;
+    bool fusion, have_ket;
+    Xoshiro256 rng;
+    vector<complex<R>> ket, send, recv;
+
+    // amplitudes are traded in pieces of at most this many, which bounds the extra memory needed
+    static const size_t PIECE = size_t(1)<<16;
+
+    // Trades the amplitudes at the given indices with the partner, which gives its own for the same indices.
+    template <typename F>
+    void trade (int partner, size_t count, const F &index) {
+      for (size_t begin=0; begin<count; begin+=PIECE){
+        size_t end = min(count,begin+PIECE);
+        send.resize(end-begin);
+        recv.resize(end-begin);
+        for (size_t i=begin; i<end; i++){
+          send[i-begin] = ket[index(i)];
+        }
+        transport.exchange(partner, send.data(), recv.data(), (end-begin)*sizeof(complex<R>));
+        for (size_t i=begin; i<end; i++){
+          ket[index(i)] = recv[i-begin];
+        }
+      }
+    }
+
+    // Swaps the bits at positions p0 and p1 of the whole ket, across ranks where needed.
+    void swap_positions (int p0, int p1) {
+      if (p0>p1){
+        swap(p0,p1);
+      }
+      if (p1<local){
+        FusedGate exchange;
+        exchange.kind = FusedGate::SWAP;
+        exchange.q0 = p0;
+        exchange.q1 = p1;
+        apply_fused(exchange, ket.data(), ket.size(), (WorkerPool*)NULL);
+      } else if (p0<local){
+        // the amplitudes whose bit p0 differs from this rank's bit p1 go to the rank that differs only in that bit
+        int bit = (transport.rank()>>(p1-local))&1;
+        size_t flip = bit ? 0 : size_t(1)<<p0;
+        trade(transport.rank()^(1<<(p1-local)), ket.size()/2, [p0,flip](size_t i){ return insert_zero_bit(i,p0)|flip; });
+      } else {
+        // a rank whose two bits differ trades everything with the rank that has them the other way round
+        int b0 = (transport.rank()>>(p0-local))&1;
+        int b1 = (transport.rank()>>(p1-local))&1;
+        if (b0!=b1){
+          trade(transport.rank()^(1<<(p0-local))^(1<<(p1-local)), ket.size(), [](size_t i){ return i; });
+        }
+      }
+    }
+
+    void simulate () {
+
+      verify_static(qc, "DistributedSimulator");
+      ket.assign(size_t(1)<<local, complex<R>(0.0,0.0));
+      if (transport.rank()==0){
+        ket[0] = 1.0;
+      }
+
+      vector<FusedGate> fused;
+      fuse_gates(qc, fused, fusion);
+      QubitLayout layout;
+      layout.reset(qc.nQubits);
+
+      for (size_t g=0; g<fused.size(); g++){
+        if (fused[g].kind==FusedGate::INIT){
+          layout.reset(qc.nQubits);
+          apply_init(qc, fused[g], ket.data(), size_t(1)<<qc.nQubits, offset(), ket.size());
+          continue;
+        }
+        int qubits[2] = {fused[g].q0, fused[g].q1};
+        for (int j=0; j<2; j++){
+          if (qubits[j]>=0 && layout.where[qubits[j]]>=local){
+            int p = layout.evict(fused,g,local);
+            swap_positions(p, layout.where[qubits[j]]);
+            layout.swap_positions(p, layout.where[qubits[j]]);
           }
+        }
+        apply_fused(layout.place(fused[g]), ket.data(), ket.size(), (WorkerPool*)NULL);
+      }
+
+      for (int q=0; q<qc.nQubits; q++){
+        if (layout.where[q]!=q){
+          int p = layout.where[q];
+          swap_positions(q, p);
+          layout.swap_positions(q, p);
+        }
       }
 
-      return qiskitPy;
     }
 
-    string get_qasm () {
-      string qasm;
-      // initial qasm header
-      qasm += "OPENQASM 2.0;\ninclude \"qelib1.inc\";\n";
-      // qreg
-      qasm += "qreg q["+to_string(qc.nQubits)+"];\n";
-      // creg
-      if (qc.nBits!=0){ // maybe don't do this and always print it
-        qasm += "creg c["+to_string(qc.nBits)+"];\n"; 
+};
+
+typedef BasicDistributedSimulator<double> DistributedSimulator;
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+// The ket of n qubits, stored in a file that is mapped into memory. Only the parts in use need to be in RAM, and the
+// operating system pages the rest to and from disk, so the ket can be as large as the disk allows.
+// The file is created (or emptied) by the constructor, starting as all zeros, and removed by the destructor.
+template <typename R>
+class MappedKet {
+
+  public:
+
+    MappedKet (const string &path_in, int n) {
+      path = path_in;
+      count = size_t(1)<<n;
+      size_t bytes = count*sizeof(complex<R>);
+      fd = open(path.c_str(), O_RDWR|O_CREAT|O_TRUNC, 0600);
+      if (fd<0 || ftruncate(fd, bytes)!=0){
+        ERROR("MappedKet: Could not create "+path);
       }
-      // gates
-      for (int g=0; g<qc.data.size(); g++){
-          if (qc.data[g][0]=="x"){
-            qasm += "x q["+qc.data[g][1]+"];\n";
-          } else if (qc.data[g][0]=="rx") {
-            qasm += "rx("+qc.data[g][1]+") q["+qc.data[g][2]+"];\n";
-          } else if (qc.data[g][0]=="h") {
-            qasm += "h q["+qc.data[g][1]+"];\n";
-          } else if (qc.data[g][0]=="cx") {
-            qasm += "cx q["+qc.data[g][1]+"],q["+qc.data[g][2]+"];\n";
-          } else if (qc.data[g][0]=="ch") {
-            qasm += "ch q["+qc.data[g][1]+"],q["+qc.data[g][2]+"];\n";
-          } else if (qc.data[g][0]=="crx") {
-            qasm += "crx("+qc.data[g][1]+") q["+qc.data[g][2]+"],q["+qc.data[g][3]+"];\n";
-          } else if (qc.data[g][0]=="m") {
-            qasm += "measure q["+qc.data[g][1]+"] -> c["+qc.data[g][2]+"];\n";
+      void *p = mmap(NULL, bytes, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+      if (p==MAP_FAILED){
+        ERROR("MappedKet: Could not map "+path);
+      }
+      k = static_cast<complex<R>*>(p);
+    }
+
+    ~MappedKet () {
+      munmap(k, count*sizeof(complex<R>));
+      close(fd);
+      unlink(path.c_str());
+    }
+
+    // the mapping belongs to this object alone
+    MappedKet (const MappedKet&) = delete;
+    MappedKet &operator= (const MappedKet&) = delete;
+
+    complex<R> *data () {
+      return k;
+    }
+
+    size_t size () const {
+      return count;
+    }
+
+  private:
+
+    string path;
+    int fd;
+    size_t count;
+    complex<R> *k;
+
+};
+
+// Simulates circuits too large for RAM, with the ket held in a MappedKet at the given path.
+// The gates are applied in chunks of 2^chunk_qubits amplitudes (see run_blocked), which by default are 256 MB, so that the
+// file is read and written in a few passes of large sequential blocks rather than once per gate.
+// Since the ket is too large to copy, it is given as a pointer into the mapping, and counts are sampled from it directly.
+template <typename R>
+class BasicMappedSimulator {
+
+  public:
+
+    QuantumCircuit qc;
+    int shots;
+
+    BasicMappedSimulator (const QuantumCircuit &qc_in, const string &path_in, int shots_in = 1024) {
+      rng.set_seed(default_seed());
+      qc = qc_in;
+      path = path_in;
+      shots = shots_in;
+      threads = 1;
+      fusion = true;
+      chunk_qubits = 28;
+      for (size_t b=sizeof(complex<R>); b>1; b/=2){
+        chunk_qubits--;
+      }
+    }
+
+    void set_seed (unsigned long long seed) {
+      rng.set_seed(seed);
+    }
+
+    void set_fusion (bool on) {
+      fusion = on;
+      ket.reset();
+    }
+
+    // The size of the chunks, as a number of qubits. They should fit comfortably in RAM.
+    void set_chunk_qubits (int n) {
+      chunk_qubits = n;
+      ket.reset();
+    }
+
+    // Applies each gate (within a chunk) with n threads.
+    void set_threads (int n) {
+      if (n<1){
+        ERROR("set_threads: The number of threads must be at least 1");
+      }
+      threads = n;
+      workers.reset();
+    }
+
+    // Gives the 2^nQubits amplitudes, simulating on the first call. They stay valid until this object is destroyed or changed.
+    const complex<R> *get_statevector () {
+      if (!ket){
+        verify_static(qc, "MappedSimulator");
+        ket.reset(new MappedKet<R>(path, qc.nQubits));
+        ket->data()[0] = 1.0;
+        if (threads>1 && !workers){
+          workers.reset(new WorkerPool(threads));
+        }
+        vector<FusedGate> fused;
+        fuse_gates(qc, fused, fusion);
+        run_blocked(qc, ket->data(), qc.nQubits, fused, chunk_qubits, workers.get());
+      }
+      return ket->data();
+    }
+
+    size_t size () const {
+      return size_t(1)<<qc.nQubits;
+    }
+
+    map<size_t, int> get_int_counts () {
+      if(!qc.has_measurements()){
+        ERROR("get_int_counts: The circuit should have a full set of measure gates");
+      }
+      const complex<R> *k = get_statevector();
+      vector<pair<size_t, int>> sampled;
+      sample_counts_of(size(), [k](size_t j){ return norm(complex<double>(k[j])); }, shots, rng, sampled);
+      return map<size_t, int>(sampled.begin(), sampled.end());
+    }
+
+    map<string, int> get_counts () {
+      return counts_to_strings(get_int_counts(), qc.nQubits);
+    }
+
+  private:
+
+    string path;
+    int threads, chunk_qubits;
+    bool fusion;
+    Xoshiro256 rng;
+    unique_ptr<MappedKet<R>> ket;
+    unique_ptr<WorkerPool> workers;
+
+};
+
+typedef BasicMappedSimulator<double> MappedSimulator;
+typedef BasicMappedSimulator<float> FloatMappedSimulator;
+
+// A Transport for testing, which runs the ranks as processes on this machine, connected by sockets.
+// Use LocalTransport::run(ranks, body) to call body(transport) on each rank. The caller becomes rank 0, and run returns
+// there once all ranks are done. The other ranks are forked copies of the caller, which exit when body returns.
+class LocalTransport : public Transport {
+
+  public:
+
+    static void run (int ranks, const function<void(Transport&)> &body) {
+      // a socket for each pair of ranks, made before forking so that all ranks inherit them
+      vector<vector<int>> ends (ranks, vector<int>(ranks,-1));
+      for (int a=0; a<ranks; a++){
+        for (int b=a+1; b<ranks; b++){
+          int pair[2];
+          if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair)!=0){
+            ERROR("LocalTransport: Could not create sockets");
+          }
+          ends[a][b] = pair[0];
+          ends[b][a] = pair[1];
+        }
+      }
+      fflush(stdout);
+      cout.flush();
+      vector<pid_t> children;
+      int me = 0;
+      for (int r=1; r<ranks; r++){
+        pid_t pid = fork();
+        if (pid<0){
+          ERROR("LocalTransport: Could not start rank "+to_string(r));
+        }
+        if (pid==0){
+          me = r;
+          break;
+        }
+        children.push_back(pid);
+      }
+      // each rank keeps only its own ends
+      for (int a=0; a<ranks; a++){
+        for (int b=0; b<ranks; b++){
+          if (a!=me && ends[a][b]>=0){
+            close(ends[a][b]);
           }
+        }
+      }
+      {
+        LocalTransport transport (me, ends[me]);
+        body(transport);
+      }
+      if (me!=0){
+        cout.flush();
+        _exit(0);
       }
+      for (size_t c=0; c<children.size(); c++){
+        int status;
+        waitpid(children[c], &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status)!=0){
+          ERROR("LocalTransport: Rank "+to_string(c+1)+" failed");
+        }
+      }
+    }
 
-      return qasm;
+    ~LocalTransport () {
+      for (size_t r=0; r<sockets.size(); r++){
+        if (sockets[r]>=0){
+          close(sockets[r]);
+        }
+      }
+    }
+
+    int rank () const {
+      return me;
+    }
+
+    int size () const {
+      return sockets.size();
+    }
+
+    // The lower rank sends first, so that neither side can block the other with a full socket.
+    void exchange (int partner, const void *send, void *recv, size_t bytes) {
+      if (me<partner){
+        write_all(sockets[partner], send, bytes);
+        read_all(sockets[partner], recv, bytes);
+      } else {
+        read_all(sockets[partner], recv, bytes);
+        write_all(sockets[partner], send, bytes);
+      }
+    }
+
+  private:
+
+    int me;
+    vector<int> sockets; // to each other rank, by rank
+
+    LocalTransport (int me_in, const vector<int> &sockets_in) {
+      me = me_in;
+      sockets = sockets_in;
+    }
+
+    static void write_all (int fd, const void *data, size_t bytes) {
+      const char *p = static_cast<const char*>(data);
+      while (bytes>0){
+        ssize_t done = write(fd, p, bytes);
+        if (done<=0){
+          ERROR("LocalTransport: Lost connection to another rank");
+        }
+        p += done;
+        bytes -= done;
+      }
+    }
+
+    static void read_all (int fd, void *data, size_t bytes) {
+      char *p = static_cast<char*>(data);
+      while (bytes>0){
+        ssize_t done = read(fd, p, bytes);
+        if (done<=0){
+          ERROR("LocalTransport: Lost connection to another rank");
+        }
+        p += done;
+        bytes -= done;
+      }
     }
 
 };
 #endif
+
+#endif
\ No newline at end of file
@@ -0,0 +1,48 @@
+#include <iostream>
+#include <vector>
+#include <string>
+#include <chrono>
+#include "MicroQiskitCpp.h"
+
+using namespace std;
+
+// Times the simulation of layered circuits for a range of qubit numbers.
+// Each layer is an h and an rx on every qubit, followed by a chain of cx gates.
+// Usage: ./benchmark [min_qubits] [max_qubits] [layers] [threads]
+
+int main (int argc, char *argv[]) {
+
+  int minQubits = argc>1 ? atoi(argv[1]) : 10;
+  int maxQubits = argc>2 ? atoi(argv[2]) : 24;
+  int layers = argc>3 ? atoi(argv[3]) : 4;
+  int threads = argc>4 ? atoi(argv[4]) : 1;
+
+  cout << "qubits\tgates\tseconds\tns/amplitude/gate" << endl;
+
+  for (int n=minQubits; n<=maxQubits; n+=2){
+
+    QuantumCircuit qc(n);
+    for (int l=0; l<layers; l++){
+      for (int q=0; q<n; q++){
+        qc.h(q);
+        qc.rx(0.1*(q+1),q);
+      }
+      for (int q=0; q<n-1; q++){
+        qc.cx(q,q+1);
+      }
+    }
+
+    Simulator result (qc);
+    result.set_threads(threads);
+
+    auto start = chrono::steady_clock::now();
+    vector<complex<double>> ket = result.get_statevector();
+    auto stop = chrono::steady_clock::now();
+
+    double seconds = chrono::duration<double>(stop-start).count();
+    cout << n << "\t" << qc.data.size() << "\t" << seconds << "\t" << 1e9*seconds/(double(ket.size())*qc.data.size()) << endl;
+
+  }
+
+  return 0;
+}
@@ -76,8 +76,6 @@ int main () {
   cout << "\nThis circuit could be expressed in Qiskit as:" << endl;
   cout << result2.get_qiskit() << endl;
 
-  cout << "Note: It could also be expressed more efficiently in Qiskit, but MicroQiskit compiles everything down to x, rx, h and cx." << endl;
-
   // and also get the statevector
   vector<complex<double>> ket = result2.get_statevector();
 
@@ -0,0 +1,76 @@
+#include <iostream>
+#include <vector>
+#include <string>
+#include "MicroQiskitCpp.h"
+
+using namespace std;
+
+// Checks that a Simulator which reuses its results as the circuit is edited gives the same statevector as a new one.
+// Build with e.g. g++ -std=c++11 -pthread test.cpp -o test, and run ./test, which prints any failures.
+
+int failures = 0;
+
+void check (Simulator &sim, string name) {
+  Simulator fresh (sim.qc);
+  const vector<complex<double>> &a = sim.get_statevector();
+  const vector<complex<double>> &b = fresh.get_statevector();
+  double error = 0;
+  for (size_t j=0; j<a.size(); j++){
+    error = max(error, abs(a[j]-b[j]));
+  }
+  if (error>1e-12){
+    cout << "FAILED: " << name << " (error " << error << ")" << endl;
+    failures++;
+  }
+}
+
+int main () {
+
+  // undoing a gate and adding a different one leaves the number of gates unchanged
+  QuantumCircuit qc (3);
+  qc.h(0);
+  qc.cx(0,1);
+  qc.rx(0.3,2);
+  Simulator sim (qc);
+  sim.get_statevector();
+  sim.qc.data.pop_back();
+  sim.qc.ry(1.1,1);
+  check(sim, "pop then push");
+
+  // the same, with a snapshot to go back to
+  sim.snapshot();
+  sim.qc.h(2);
+  sim.get_statevector();
+  sim.qc.data.pop_back();
+  sim.qc.x(2);
+  check(sim, "pop then push after a snapshot");
+
+  // changing an earlier gate in place
+  sim.qc.data[0].gate = QuantumCircuit::X;
+  check(sim, "gate changed in place");
+
+  // replacing the circuit with another on as many qubits, and with more gates
+  QuantumCircuit other (3);
+  other.x(0);
+  other.h(1);
+  other.cx(1,2);
+  other.ry(0.7,0);
+  other.swap(0,2);
+  sim.qc = other;
+  check(sim, "circuit replaced");
+
+  // clearing the gates and adding new ones
+  sim.qc.data.clear();
+  sim.qc.h(2);
+  sim.qc.cx(2,0);
+  sim.qc.rz(0.4,0);
+  sim.qc.y(1);
+  sim.qc.crx(0.9,0,1);
+  sim.qc.h(0);
+  check(sim, "gates cleared and added again");
+
+  if (failures==0){
+    cout << "All tests passed" << endl;
+  }
+  return failures>0;
+}